@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hadrjson.h"
+
+#define BENCH_RECORDS 20000
+#define BENCH_ROUNDS 20
+
+static const char* states[] = { "ok", "pending", "failed", "retry", "unknown" };
+
+static char* bench_strings() {
+    char* s = (char*)malloc(BENCH_RECORDS * 128 + 2);
+    size_t i, len = 0;
+    s[len++] = '[';
+    for (i = 0; i < BENCH_RECORDS; i++)
+        len += sprintf(s + len, "%s{\"state\":\"%s\",\"region\":\"eu-west-%lu\",\"tag\":\"t%lu\",\"note\":\"a somewhat longer free text value\"}",
+            i ? "," : "", states[i % 5], (unsigned long)(i % 3), (unsigned long)i);
+    s[len++] = ']';
+    s[len] = '\0';
+    return s;
+}
+
+static char* bench_numbers() {
+    char* s = (char*)malloc(BENCH_RECORDS * 64 + 2);
+    size_t i, len = 0;
+    s[len++] = '[';
+    for (i = 0; i < BENCH_RECORDS; i++)
+        len += sprintf(s + len, "%s[%lu,%.6f,-%lu.25]", i ? "," : "", (unsigned long)i, i * 0.001, (unsigned long)(i % 97));
+    s[len++] = ']';
+    s[len] = '\0';
+    return s;
+}
+
+/* short non-ascii strings, where utf-8 validation weighs the most */
+static char* bench_utf8() {
+    static const char word[] = "\"caf\xC3\xA9 na\xC3\xAFve\"";
+    char* s = (char*)malloc(BENCH_RECORDS * 10 * sizeof(word) + 2);
+    size_t i, len = 0;
+    s[len++] = '[';
+    for (i = 0; i < BENCH_RECORDS * 10; i++) {
+        if (i)
+            s[len++] = ',';
+        memcpy(s + len, word, sizeof(word) - 1);
+        len += sizeof(word) - 1;
+    }
+    s[len++] = ']';
+    s[len] = '\0';
+    return s;
+}
+
+/*
+ * best of BENCH_ROUNDS parse and free rounds, to keep noise out,
+ * a negative dialect measures json_parse itself
+ */
+static void bench(const char* name, const char* json, int dialect) {
+    json_value_t v;
+    clock_t start;
+    double seconds, best = 0.0;
+    int i;
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        start = clock();
+        if ((dialect < 0 ? json_parse(&v, json) : json_parse_dialect(&v, json, dialect)) != JSON_PARSE_OK) {
+            fprintf(stderr, "%s: parse failed\n", name);
+            exit(1);
+        }
+        json_free(&v);
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (i == 0 || seconds < best)
+            best = seconds;
+    }
+    printf("%-8s %-8s %8.1f MB/s", name, dialect < 0 ? "parse" : dialect ? "relaxed" : "strict", strlen(json) / best / (1024 * 1024));
+#ifdef HADRJSON_STATS
+    {
+        json_parse_stats_t stats;
+        json_parse_stats(&v, json, &stats);
+        printf("  mallocs %lu reallocs %lu", (unsigned long)stats.mallocs, (unsigned long)stats.reallocs);
+        json_free(&v);
+    }
+#endif
+    printf("\n");
+}
+
+/* the same measure for json_parse_project keeping a single path */
+static void bench_project(const char* name, const char* json, const char* path) {
+    json_value_t v;
+    clock_t start;
+    double seconds, best = 0.0;
+    int i;
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        start = clock();
+        if (json_parse_project(&v, json, &path, 1) != JSON_PARSE_OK) {
+            fprintf(stderr, "%s: parse failed\n", name);
+            exit(1);
+        }
+        json_free(&v);
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (i == 0 || seconds < best)
+            best = seconds;
+    }
+    printf("%-8s %-8s %8.1f MB/s\n", name, "project", strlen(json) / best / (1024 * 1024));
+}
+
+int main() {
+    char* strings = bench_strings();
+    char* numbers = bench_numbers();
+    char* utf8 = bench_utf8();
+    bench("strings", strings, -1);
+    bench("strings", strings, 0);
+    bench("strings", strings, JSON_DIALECT_ALL);
+    bench_project("strings", strings, "state");
+    bench("numbers", numbers, -1);
+    bench("numbers", numbers, 0);
+    bench("numbers", numbers, JSON_DIALECT_ALL);
+    bench("utf8", utf8, -1);
+    bench("utf8", utf8, JSON_DIALECT_ALL);
+    free(strings);
+    free(numbers);
+    free(utf8);
+    return 0;
+}
@@ -5,8 +5,58 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <float.h>
+#include <stdio.h>
 #include "hadrjson.h"
 
+#ifndef HADRJSON_NO_THREADS
+#include <pthread.h>
+#endif
+
+/* the ssse3 utf-8 validator is built in, or compiled for ssse3 alone and picked at run time */
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#define UTF8_SIMD
+#define UTF8_TARGET
+#define UTF8_HAS_SIMD() 1
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 5)
+#include <tmmintrin.h>
+#define UTF8_SIMD
+#define UTF8_TARGET __attribute__((target("ssse3")))
+#define UTF8_HAS_SIMD() __builtin_cpu_supports("ssse3")
+#endif
+
+/* aligned loads may read past the terminator, which address sanitizer reports */
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+#include <emmintrin.h>
+#define JSON_SKIP_SIMD
+#endif
+
+#ifdef HADRJSON_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_CYCLES() ((unsigned long)__rdtsc())
+#else
+#include <time.h>
+#define STATS_CYCLES() ((unsigned long)clock())
+#endif
+#define STATS_PARAM , json_parse_stats_t* stats
+#define STATS_ARG , stats
+#define STATS_NONE , NULL
+#define STATS(x) do { if (stats) { x; } } while(0)
+/* containers around the value being parsed, only needed for max_depth */
+#define DEPTH_PARAM , size_t depth
+#define DEPTH_ARG(d) , (d)
+#else
+#define STATS_PARAM
+#define STATS_ARG
+#define STATS_NONE
+#define STATS(x) do { } while(0)
+#define DEPTH_PARAM
+#define DEPTH_ARG(d)
+#endif
+
 #define ISDIGIT(ch) ((ch) >= '0' && (ch) <= '9')
 #define ISDIGIT1TO9(ch) ((ch) >= '1' && (ch) <= '9')
 
@@ -14,13 +64,14 @@ static bool is_whitespace(char c) {
     return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
 }
 
-static int __json_parse_literal(const char* str, const char** end, const char *literal, JSON_TYPE type, json_value_t* v) {
+static int __json_parse_literal(const char* str, const char** end, const char *literal, JSON_TYPE type, json_value_t* v STATS_PARAM) {
     size_t len;
     len = strlen(literal);
     if (strncmp(str, literal, len))
         return JSON_PARSE_INVALID_VALUE;
     *end = str + len;
     v->type = type;
+    STATS(stats->nodes[type]++);
     return JSON_PARSE_OK;
 }
 
@@ -83,346 +134,1293 @@ static int __json_parse_unicode(const char* str, const char** end, char* p, size
     return JSON_PARSE_OK;
 }
 
-static int __json_parse_string_length(const char* str, size_t *len) {
-    char p[4];
-    size_t ret, utf8_len;
-    for (;;) {
-        if (*str == '\0')
-            return JSON_PARSE_MISS_QUOTATION_MARK;
-        if (*str == '\"')
-            break;
-        if (*(unsigned char*)str < 0x20)
-            return JSON_PARSE_INVALID_STRING_CHAR;
-        if (*str == '\\') {
-            str++;
-            if (!*str)
-                return JSON_PARSE_INVALID_STRING_ESCAPE;
-            if (*str == 'u') {
-                str++;
-                if ((ret = __json_parse_unicode(str, &str, p, &utf8_len)) != JSON_PARSE_OK) {
-                    return ret;
-                }
-                *len += utf8_len;
+#ifdef HADRJSON_NO_UTF8_VALIDATION
+#define UTF8_VALIDATION 0
+#else
+#define UTF8_VALIDATION 1
+#endif
+
+#define UTF8_ASCII_MASK ((unsigned long)-1 / 0xFF * 0x80)
+
+/*
+ * Length of the sequence at p, which starts with a byte of 0x80 or more, or 0
+ * when it is not valid utf-8. The input ends at end, or at its terminator
+ * when end is NULL, a terminator is never a continuation byte.
+ */
+static size_t __json_utf8_sequence(const unsigned char* p, const unsigned char* end) {
+    unsigned char c = p[0], lo = 0x80, hi = 0xBF;
+    size_t i, n;
+    if      (c >= 0xC2 && c <= 0xDF) n = 2;
+    else if (c == 0xE0) { n = 3; lo = 0xA0; }
+    else if (c == 0xED) { n = 3; hi = 0x9F; }
+    else if (c >= 0xE1 && c <= 0xEF) n = 3;
+    else if (c == 0xF0) { n = 4; lo = 0x90; }
+    else if (c >= 0xF1 && c <= 0xF3) n = 4;
+    else if (c == 0xF4) { n = 4; hi = 0x8F; }
+    else
+        return 0;
+    if (end && (size_t)(end - p) < n)
+        return 0;
+    if (p[1] < lo || p[1] > hi)
+        return 0;
+    for (i = 2; i < n; i++)
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+    return n;
+}
+
+static int __json_validate_utf8_scalar(const unsigned char* s, size_t len) {
+    size_t i = 0, n;
+    unsigned long w;
+    while (i < len) {
+        if (len - i >= sizeof(w)) {
+            memcpy(&w, s + i, sizeof(w));
+            if (!(w & UTF8_ASCII_MASK)) {
+                i += sizeof(w);
                 continue;
             }
         }
-        str++;
-        ++*len;
+        if (s[i] < 0x80) {
+            i++;
+            continue;
+        }
+        if (!(n = __json_utf8_sequence(s + i, s + len)))
+            return JSON_PARSE_INVALID_UTF8;
+        i += n;
     }
     return JSON_PARSE_OK;
 }
 
-static int __json_parse_string_raw(const char* src, const char** end, char* dst) {
-    size_t ret, utf8_len;
-    char* p = dst;
-    while (*src != '\"') {
-        if (*src == '\\') {
-            src++;
-            switch (*src) {
-                case '\"':
-                    *p = '\"';
-                    break;
-                case '\\':
-                    *p = '\\';
-                    break;
-                case '/':
-                    *p = '/';
-                    break;
-                case 'b':
-                    *p = '\b';
-                    break;
-                case 'f':
-                    *p = '\f';
-                    break;
-                case 'n':
-                    *p = '\n';
-                    break;
-                case 'r':
-                    *p = '\r';
-                    break;
-                case 't':
-                    *p = '\t';
-                    break;
-                case 'u':
-                    src++;
-                    if ((ret = __json_parse_unicode(src, &src, p, &utf8_len)) != JSON_PARSE_OK) {
-                        return ret;
-                    }
-                    p += utf8_len;
-                    continue;
-                default:
-                    return JSON_PARSE_INVALID_STRING_ESCAPE;
-            }
-        } else
-            *p = *src;
-        src++;
-        p++;
+#ifdef UTF8_SIMD
+/*
+ * Keiser & Lemire lookup validation: each byte is classified by the high and
+ * low nibble of its predecessor and the high nibble of itself, the three
+ * table lookups are and-ed so that only an invalid pair keeps a bit set.
+ */
+#define UTF8_TOO_SHORT  0x01
+#define UTF8_TOO_LONG   0x02
+#define UTF8_OVERLONG_3 0x04
+#define UTF8_TOO_LARGE  0x08
+#define UTF8_SURROGATE  0x10
+#define UTF8_OVERLONG_2 0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4 0x40
+#define UTF8_TWO_CONTS  0x80
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+#define UTF8_B(x) ((char)(x))
+
+UTF8_TARGET static __m128i __json_validate_utf8_block(__m128i input, __m128i prev) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_B(UTF8_TWO_CONTS), UTF8_B(UTF8_TWO_CONTS), UTF8_B(UTF8_TWO_CONTS), UTF8_B(UTF8_TWO_CONTS),
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        UTF8_B(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+        UTF8_B(UTF8_CARRY | UTF8_OVERLONG_2),
+        UTF8_B(UTF8_CARRY),
+        UTF8_B(UTF8_CARRY),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        UTF8_B(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000));
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_B(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+        UTF8_B(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+        UTF8_B(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+        UTF8_B(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    __m128i prev1, prev2, prev3, special, must23;
+    prev1 = _mm_alignr_epi8(input, prev, 15);
+    prev2 = _mm_alignr_epi8(input, prev, 14);
+    prev3 = _mm_alignr_epi8(input, prev, 13);
+    special = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+    /* third and fourth bytes of a sequence must be continuations */
+    must23 = _mm_or_si128(
+        _mm_subs_epu8(prev2, _mm_set1_epi8(UTF8_B(0xE0 - 0x80))),
+        _mm_subs_epu8(prev3, _mm_set1_epi8(UTF8_B(0xF0 - 0x80))));
+    must23 = _mm_and_si128(must23, _mm_set1_epi8(UTF8_B(0x80)));
+    return _mm_xor_si128(must23, special);
+}
+
+UTF8_TARGET static int __json_validate_utf8_simd(const unsigned char* s, size_t len) {
+    const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, UTF8_B(0xF0 - 1), UTF8_B(0xE0 - 1), UTF8_B(0xC0 - 1));
+    __m128i input, prev, error, incomplete;
+    unsigned char tail[16];
+    size_t i;
+    prev = error = incomplete = _mm_setzero_si128();
+    for (i = 0; i + 16 <= len; i += 16) {
+        input = _mm_loadu_si128((const __m128i*)(s + i));
+        if (!_mm_movemask_epi8(input)) {
+            error = _mm_or_si128(error, incomplete);
+            incomplete = _mm_setzero_si128();
+        } else {
+            error = _mm_or_si128(error, __json_validate_utf8_block(input, prev));
+            incomplete = _mm_subs_epu8(input, max);
+        }
+        prev = input;
     }
-    *p = '\0';
-    *end = src + 1;
+    /* zero padding is ascii, so a truncated last sequence is caught too */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, s + i, len - i);
+    input = _mm_loadu_si128((const __m128i*)tail);
+    error = _mm_or_si128(error, __json_validate_utf8_block(input, prev));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF)
+        return JSON_PARSE_INVALID_UTF8;
     return JSON_PARSE_OK;
 }
+#endif
 
-static int __json_parse_string_common(const char* src, const char** end, size_t* len, char** dst) {
-    int ret;
-    src++;
-    if ((ret = __json_parse_string_length(src, len)) != JSON_PARSE_OK)
-        return ret;
-    *dst = (char*)malloc((*len + 1));
-    assert(dst);
-	if ((ret = __json_parse_string_raw(src, end, *dst)) != JSON_PARSE_OK) {
-        free(*dst);
-	}
-    return ret;
+static int __json_validate_utf8(const unsigned char* s, size_t len) {
+#ifdef UTF8_SIMD
+    if (len >= 16 && UTF8_HAS_SIMD())
+        return __json_validate_utf8_simd(s, len);
+#endif
+    return __json_validate_utf8_scalar(s, len);
 }
 
-static int __json_parse_string(const char* str, const char** end, json_value_t* v) {
-    size_t len;
-    int ret;
-    len = 0;
-    if ((ret = __json_parse_string_common(str, end, &len, &v->u.s.s)) != JSON_PARSE_OK)
-        return ret;
-    v->u.s.len = len;
-    v->type = JSON_STRING;
-    return ret;
-}
+/* the next character of input that ends at end, or at its terminator when end is NULL */
+#define SCAN_PEEK(p, end) (!(end) || (p) < (end) ? *(p) : '\0')
+/* enough significant digits to round like strtod at the edge of the double range */
+#define SCAN_DIGITS_MAX 330
 
-static int __json_parse_number(const char* str, const char** end, json_value_t* v) {
+/*
+ * Scan the number at str without converting it. Overflow is found from the
+ * decimal exponent of the first significant digit, only numbers of the same
+ * magnitude as DBL_MAX are handed to strtod, on a bounded copy of their digits.
+ */
+static int __json_scan_number(const char* str, const char* end, const char** stop) {
+    char buf[SCAN_DIGITS_MAX + 8];
     const char* p = str;
-    if (*p == '-')
+    const char* digits = NULL;
+    const char* mantissa;
+    long e10 = 0, exp = 0;
+    size_t n;
+    int neg;
+    double d;
+    if (SCAN_PEEK(p, end) == '-')
         p++;
-    if (*p == '0') {
-        if (ISDIGIT(p[1]) || p[1] == 'x' || p[1] == 'X')
-            return JSON_PARSE_ROOT_NOT_SINGULAR;
+    if (SCAN_PEEK(p, end) == '0') {
         p++;
-    } else if (ISDIGIT1TO9(*p)) {
-        for (p++; ISDIGIT(*p); p++);
+        if (ISDIGIT(SCAN_PEEK(p, end)) || SCAN_PEEK(p, end) == 'x' || SCAN_PEEK(p, end) == 'X')
+            return JSON_PARSE_ROOT_NOT_SINGULAR;
+    } else if (ISDIGIT1TO9(SCAN_PEEK(p, end))) {
+        digits = p;
+        for (p++; ISDIGIT(SCAN_PEEK(p, end)); p++);
+        e10 = (long)(p - digits) - 1;
     } else {
         return JSON_PARSE_INVALID_VALUE;
     }
-    if (*p == '.') {
-        if (!ISDIGIT(*++p))
+    if (SCAN_PEEK(p, end) == '.') {
+        p++;
+        if (!ISDIGIT(SCAN_PEEK(p, end)))
             return JSON_PARSE_INVALID_VALUE;
-        for (p++; ISDIGIT(*p); p++);
+        for (mantissa = p; ISDIGIT(SCAN_PEEK(p, end)); p++) {
+            if (!digits && *p != '0') {
+                digits = p;
+                e10 = -(long)(p - mantissa) - 1;
+            }
+        }
     }
-    if (*p == 'e' || *p == 'E') {
+    mantissa = p;
+    if (SCAN_PEEK(p, end) == 'e' || SCAN_PEEK(p, end) == 'E') {
         p++;
-        if (*p == '+' || *p == '-') p++;
-        for (; ISDIGIT(*p); p++);
+        neg = SCAN_PEEK(p, end) == '-';
+        if (SCAN_PEEK(p, end) == '+' || SCAN_PEEK(p, end) == '-')
+            p++;
+        if (!ISDIGIT(SCAN_PEEK(p, end)))
+            return JSON_PARSE_INVALID_VALUE;
+        for (; ISDIGIT(SCAN_PEEK(p, end)); p++)
+            if (exp < 100000000L)
+                exp = exp * 10 + (*p - '0');
+        e10 += neg ? -exp : exp;
     }
+    *stop = p;
+    if (!digits || e10 < DBL_MAX_10_EXP)
+        return JSON_PARSE_OK;
+    if (e10 > DBL_MAX_10_EXP)
+        return JSON_PARSE_NUMBER_TOO_BIG;
+    buf[0] = *digits;
+    buf[1] = '.';
+    for (n = 2, digits++; digits < mantissa && n < SCAN_DIGITS_MAX; digits++)
+        if (*digits != '.')
+            buf[n++] = *digits;
+    sprintf(buf + n, "e%d", DBL_MAX_10_EXP);
     errno = 0;
-    v->u.n = strtod(str, (char**)end);
-    if (errno == ERANGE && (v->u.n == HUGE_VAL || v->u.n == -HUGE_VAL))
+    d = strtod(buf, NULL);
+    if (errno == ERANGE && d == HUGE_VAL)
         return JSON_PARSE_NUMBER_TOO_BIG;
-    v->type = JSON_NUMBER;
     return JSON_PARSE_OK;
 }
 
-static int __json_parse_value(const char* str, const char** end, json_value_t* v);
+#ifdef JSON_SKIP_SIMD
+/*
+ * Step to the next quote, backslash or control character (the terminator
+ * included) sixteen bytes at a time. Loads are aligned so they never cross
+ * into the next page, with a bounded input they also stay before end. Bytes
+ * with the high bit set are noted in high.
+ */
+static const char* __json_find_special(const char* p, const char* end, unsigned char* high) {
+    const __m128i quote = _mm_set1_epi8('\"'), bslash = _mm_set1_epi8('\\'), ctrl = _mm_set1_epi8(0x1F);
+    __m128i x;
+    unsigned int mask, top;
+    unsigned char c;
+    while (((size_t)p & 15) || (end && end - p < 16)) {
+        if (end && p >= end)
+            return p;
+        c = *(const unsigned char*)p;
+        if (c == '\"' || c == '\\' || c < 0x20)
+            return p;
+        *high |= c;
+        p++;
+    }
+    for (; !end || end - p >= 16; p += 16) {
+        x = _mm_load_si128((const __m128i*)p);
+        mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, bslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl)));
+        top = (unsigned int)_mm_movemask_epi8(x);
+        if (mask) {
+            if (top & ((mask & (0U - mask)) - 1))
+                *high |= 0x80;
+            return p + __builtin_ctz(mask);
+        }
+        if (top)
+            *high |= 0x80;
+    }
+    return p;
+}
+
+/*
+ * The vector scan for the rest of a long string. The run it skips starts after
+ * a whole sequence and stops before an ascii byte, so it is validated alone.
+ */
+static const char* __json_find_special_utf8(const char* p, const char* end, int* ret) {
+    const char* run = p;
+    unsigned char high = 0;
+    p = __json_find_special(p, end, &high);
+    if (UTF8_VALIDATION && (high & 0x80) && __json_validate_utf8((const unsigned char*)run, p - run) != JSON_PARSE_OK)
+        *ret = JSON_PARSE_INVALID_UTF8;
+    return p;
+}
+#endif
 
-static int __json_parse_array(const char* str, const char** end, json_value_t* v) {
-    json_value_t e, *curr;
-    size_t i, size = 0;
-    int ret = JSON_PARSE_OK;
-    str++;
-    while (is_whitespace(*str))
-        str++;
-    if (*str == ']') {
-        *end = str + 1;
-        v->type = JSON_ARRAY;
-        v->u.a.e = NULL;
-        v->u.a.size = 0;
+static int __json_scan_unicode(const char** str, const char* end) {
+    const char* p = *str;
+    unsigned int u;
+    int ret;
+    if (end && end - p < 4)
+        return JSON_PARSE_INVALID_UNICODE_HEX;
+    if ((ret = __json_parse_hex(p, &p, &u)) != JSON_PARSE_OK)
         return ret;
+    if (u >= 0xD800 && u <= 0xDBFF) {
+        if (SCAN_PEEK(p, end) != '\\' || SCAN_PEEK(p + 1, end) != 'u')
+            return JSON_PARSE_INVALID_UNICODE_SURROGATE;
+        p += 2;
+        if (end && end - p < 4)
+            return JSON_PARSE_INVALID_UNICODE_HEX;
+        if ((ret = __json_parse_hex(p, &p, &u)) != JSON_PARSE_OK)
+            return ret;
+        if (u <= 0xDC00 || u > 0xDFFF)
+            return JSON_PARSE_INVALID_UNICODE_SURROGATE;
     }
+    *str = p;
+    return JSON_PARSE_OK;
+}
+
+/* validate the string at str, from its opening quote, without decoding it */
+static int __json_scan_string(const char* str, const char* end, const char** stop) {
+    const char* p = str + 1;
+    size_t n;
+    char c;
+    int ret = JSON_PARSE_OK;
     for (;;) {
-        json_init(&e);
-        if ((ret = __json_parse_value(str, &str, &e)) != JSON_PARSE_OK) {
-            break;
-        }
-        size++;
-        if (size == 1) {
-            v->u.a.e = (json_value_t*)malloc(sizeof(json_value_t));
-        } else {
-            v->u.a.e = (json_value_t*)realloc(v->u.a.e, size * sizeof(json_value_t));
+#ifdef JSON_SKIP_SIMD
+        if (p - str > 16) {
+            p = __json_find_special_utf8(p, end, &ret);
+            if (ret != JSON_PARSE_OK)
+                return ret;
         }
-        curr = v->u.a.e + size - 1;
-        memcpy(curr, &e, sizeof(json_value_t));
-        while (is_whitespace(*str))
-            str++;
-        if (*str == ',') {
-            str++;
-            while (is_whitespace(*str))
-                str++;
-            if (*str == '\0') {
-                ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
-                break;
-            }
-        } else if (*str == ']') {
-            *end = str + 1;
-            v->type = JSON_ARRAY;
-            v->u.a.size = size;
-            break;
-        } else {
-            ret =  JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+#endif
+        c = SCAN_PEEK(p, end);
+        if (c == '\0')
+            return JSON_PARSE_MISS_QUOTATION_MARK;
+        if (c == '\"')
             break;
+        if ((unsigned char)c < 0x20)
+            return JSON_PARSE_INVALID_STRING_CHAR;
+        if (c == '\\') {
+            p++;
+            switch (SCAN_PEEK(p, end)) {
+                case '\"': case '\\': case '/':
+                case 'b': case 'f': case 'n': case 'r': case 't':
+                    break;
+                case 'u':
+                    p++;
+                    if ((ret = __json_scan_unicode(&p, end)) != JSON_PARSE_OK)
+                        return ret;
+                    continue;
+                default:
+                    return JSON_PARSE_INVALID_STRING_ESCAPE;
+            }
+        } else if (UTF8_VALIDATION && (unsigned char)c >= 0x80) {
+            if (!(n = __json_utf8_sequence((const unsigned char*)p, (const unsigned char*)end)))
+                return JSON_PARSE_INVALID_UTF8;
+            p += n;
+            continue;
         }
+        p++;
     }
-    if (ret != JSON_PARSE_OK) {
-        for (i = 0; i < size; i++)
-            json_free(&v->u.a.e[i]);
-        free(v->u.a.e);
-        v->type = JSON_NULL;
-    }
-    return ret;
+    *stop = p + 1;
+    return JSON_PARSE_OK;
 }
 
-static void __json_init_member(json_member_t* m) {
-    m->k = NULL;
-    m->klen = 0;
-    json_init(&m->v);
+/* first heap buffer of a decoded string, also the stack buffer for keys */
+#define STRING_HEAP_MIN 64
+
+/* make room for need bytes, moving the string out of local the first time */
+static char* __json_string_grow(char* buf, const char* local, size_t n, size_t* cap, size_t need STATS_PARAM) {
+    size_t size = *cap * 2 > need ? *cap * 2 : need;
+    if (buf == local) {
+        if (size < STRING_HEAP_MIN)
+            size = STRING_HEAP_MIN;
+        buf = (char*)malloc(size);
+        assert(buf);
+        memcpy(buf, local, n);
+        STATS(stats->mallocs++);
+    } else {
+        buf = (char*)realloc(buf, size);
+        assert(buf);
+        STATS(stats->reallocs++);
+    }
+    *cap = size;
+    return buf;
 }
 
-static int __json_parse_object(const char* str, const char** end, json_value_t* v) {
-    json_member_t m, *curr;
-    size_t i, size = 0;
+/*
+ * Decodes the string body at src in a single pass. The result goes to local
+ * while it fits in cap bytes with its terminator, otherwise to a buffer of
+ * its own, *dst tells which one.
+ */
+static int __json_parse_string_decode(const char* src, const char** end, char* local, size_t cap, char** dst, size_t* len STATS_PARAM) {
+    const char* run;
+    char* buf = local;
+    char u[4];
+    size_t n = 0, utf8_len, seq;
+    unsigned char c;
     int ret = JSON_PARSE_OK;
-    str++;
-    while(is_whitespace(*str))
-        str++;
-    if (*str == '}') {
-        *end = str + 1;
-        v->type = JSON_OBJECT;
-        v->u.o.size = 0;
-        v->u.o.m = NULL;
-        return ret;
-    }
     for (;;) {
-        __json_init_member(&m);
-        if (*str != '\"') {
-            ret = JSON_PARSE_MISS_KEY;
-            break;
+        run = src;
+        while ((c = *(const unsigned char*)src) != '\"' && c != '\\' && c >= 0x20) {
+            /* utf-8 is checked here a sequence at a time, not in a second pass */
+            if (UTF8_VALIDATION && c >= 0x80) {
+                /* two byte sequences, most of latin text, are checked without a call */
+                if (c >= 0xC2 && c <= 0xDF && (src[1] & 0xC0) == 0x80)
+                    seq = 2;
+                else if (!(seq = __json_utf8_sequence((const unsigned char*)src, NULL))) {
+                    ret = JSON_PARSE_INVALID_UTF8;
+                    break;
+                }
+                src += seq;
+            } else {
+                src++;
+            }
+#ifdef JSON_SKIP_SIMD
+            /* most strings end within a few bytes, only long runs are worth the vector scan */
+            if (src - run >= 16)
+                src = __json_find_special_utf8(src, NULL, &ret);
+#endif
         }
-        if ((ret = __json_parse_string_common(str, &str, &m.klen, &m.k)) != JSON_PARSE_OK)
+        if (ret != JSON_PARSE_OK)
             break;
-        while (is_whitespace(*str))
-            str++;
-        if (*str != ':') {
-            ret = JSON_PARSE_MISS_COLON;
+        if (n + (src - run) + 1 > cap)
+            buf = __json_string_grow(buf, local, n, &cap, n + (src - run) + 1 STATS_ARG);
+        memcpy(buf + n, run, src - run);
+        n += src - run;
+        if (c == '\"')
             break;
-        }
-        str++;
-        while (is_whitespace(*str))
-            str++;
-        if ((ret = __json_parse_value(str, &str, &m.v)) != JSON_PARSE_OK)
+        if (c != '\\') {
+            ret = c ? JSON_PARSE_INVALID_STRING_CHAR : JSON_PARSE_MISS_QUOTATION_MARK;
             break;
-        size++;
-        if (size == 1) {
-            v->u.o.m = (json_member_t*)malloc(sizeof(json_member_t));
-        } else {
-            v->u.o.m = (json_member_t*)realloc(v->u.o.m, size * sizeof(json_member_t));
         }
-        curr = v->u.o.m + size - 1;
-        memcpy(curr, &m, sizeof(json_member_t));
-        while(is_whitespace(*str))
-            str++;
-        if (*str == ',') {
-            str++;
-            while(is_whitespace(*str))
-                str++;
-        } else if (*str == '}') {
-            *end = str + 1;
-            v->type = JSON_OBJECT;
-            v->u.o.size = size;
-            break;
-        } else {
-            ret = JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
-            break;
+        STATS(stats->escapes++);
+        if (n + 2 > cap)
+            buf = __json_string_grow(buf, local, n, &cap, n + 2 STATS_ARG);
+        switch (*++src) {
+            case '\"': case '\\': case '/':
+                buf[n++] = *src;
+                break;
+            case 'b': buf[n++] = '\b'; break;
+            case 'f': buf[n++] = '\f'; break;
+            case 'n': buf[n++] = '\n'; break;
+            case 'r': buf[n++] = '\r'; break;
+            case 't': buf[n++] = '\t'; break;
+            case 'u':
+                if ((ret = __json_parse_unicode(src + 1, &src, u, &utf8_len)) != JSON_PARSE_OK)
+                    break;
+                if (n + utf8_len + 1 > cap)
+                    buf = __json_string_grow(buf, local, n, &cap, n + utf8_len + 1 STATS_ARG);
+                memcpy(buf + n, u, utf8_len);
+                n += utf8_len;
+                continue;
+            default:
+                ret = JSON_PARSE_INVALID_STRING_ESCAPE;
+                break;
         }
+        if (ret != JSON_PARSE_OK)
+            break;
+        src++;
     }
     if (ret != JSON_PARSE_OK) {
-        for (i = 0; i < size; i++) {
-            free(v->u.o.m->k);
-            json_free(&v->u.o.m[i].v);
-        }
-        v->type = JSON_NULL;
+        if (buf != local)
+            free(buf);
+        return ret;
     }
-    return ret;
+    /* doubling leaves at most half unused, give it back only when that is worth a call */
+    if (buf != local && cap - (n + 1) >= STRING_HEAP_MIN) {
+        buf = (char*)realloc(buf, n + 1);
+        assert(buf);
+        STATS(stats->reallocs++);
+    }
+    buf[n] = '\0';
+    *dst = buf;
+    *len = n;
+    *end = src + 1;
+    return JSON_PARSE_OK;
 }
 
-static int __json_parse_value(const char* str, const char** end, json_value_t* v) {
-    switch (*str) {
-        case 'n':  return __json_parse_literal(str, end, "null", JSON_NULL, v);
-        case 't':  return __json_parse_literal(str, end, "true", JSON_TRUE, v);
-        case 'f':  return __json_parse_literal(str, end, "false", JSON_FALSE, v);
-        case '"':  return __json_parse_string(str, end, v);
-        case '[':  return __json_parse_array(str, end, v);
-        case '{':  return __json_parse_object(str, end, v);
-        default:   return __json_parse_number(str, end, v);
-        case '\0': return JSON_PARSE_EXPECT_VALUE;
+static int __json_parse_string_common(const char* src, const char** end, size_t* len, char** dst STATS_PARAM) {
+    char local[STRING_HEAP_MIN];
+    char* s;
+    int ret;
+#ifdef HADRJSON_STATS
+    unsigned long start = stats ? STATS_CYCLES() : 0;
+#endif
+    *dst = NULL;
+    if ((ret = __json_parse_string_decode(src + 1, end, local, sizeof(local), &s, len STATS_ARG)) != JSON_PARSE_OK)
+        return ret;
+    if (s == local) {
+        s = (char*)malloc(*len + 1);
+        assert(s);
+        memcpy(s, local, *len + 1);
+        STATS(stats->mallocs++);
     }
+    *dst = s;
+    STATS(stats->string_cycles += STATS_CYCLES() - start);
+    return ret;
 }
 
-int json_parse(json_value_t* v, const char* str) {
+static int __json_parse_number(const char* str, const char** end, json_value_t* v STATS_PARAM) {
+    const char* p;
     int ret;
-    assert(v != NULL);
-    json_init(v);
-    while (is_whitespace(*str))
-        str++;
-    if ((ret = __json_parse_value(str, &str, v)) == JSON_PARSE_OK) {
+#ifdef HADRJSON_STATS
+    unsigned long start = stats ? STATS_CYCLES() : 0;
+#endif
+    if ((ret = __json_scan_number(str, NULL, &p)) != JSON_PARSE_OK)
+        return ret;
+    v->u.n = strtod(str, NULL);
+    *end = p;
+    STATS(stats->number_cycles += STATS_CYCLES() - start);
+    v->type = JSON_NUMBER;
+    STATS(stats->nodes[JSON_NUMBER]++);
+    return JSON_PARSE_OK;
+}
+
+static void __json_init_member(json_member_t* m) {
+    m->k = NULL;
+    m->klen = 0;
+    json_init(&m->v);
+}
+
+static const char* __json_skip_comments(const char* str) {
+    const char* p;
+    for (;;) {
         while (is_whitespace(*str))
             str++;
-        if (*str != '\0') {
-            json_free(v);
-            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        if (str[0] != '/')
+            return str;
+        if (str[1] == '/') {
+            for (str += 2; *str != '\0' && *str != '\n'; str++);
+        } else if (str[1] == '*' && (p = strstr(str + 2, "*/")) != NULL) {
+            str = p + 2;
+        } else {
+            return str;
         }
     }
-    return ret;
 }
 
-void json_free(json_value_t* v) {
-    size_t i;
-    assert(v != NULL);
-    switch (v->type) {
-        case JSON_STRING:
-            free(v->u.s.s);
+/* measures a single-quoted string when dst is NULL, decodes it otherwise */
+static int __json_parse_squote_raw(const char* src, const char** end, char* dst, size_t* len) {
+    char buf[4], ch;
+    size_t n = 0, utf8_len;
+    int ret;
+    for (;;) {
+        ch = *src;
+        if (ch == '\'')
             break;
-        case JSON_ARRAY:
-            for (i = 0; i < v->u.a.size; i++)
-                json_free(&v->u.a.e[i]);
-            free(v->u.a.e);
-        default: break;
+        if (ch == '\0')
+            return JSON_PARSE_MISS_QUOTATION_MARK;
+        if ((unsigned char)ch < 0x20)
+            return JSON_PARSE_INVALID_STRING_CHAR;
+        if (ch == '\\') {
+            src++;
+            switch (*src) {
+                case '\'': ch = '\''; break;
+                case '\"': ch = '\"'; break;
+                case '\\': ch = '\\'; break;
+                case '/':  ch = '/';  break;
+                case 'b':  ch = '\b'; break;
+                case 'f':  ch = '\f'; break;
+                case 'n':  ch = '\n'; break;
+                case 'r':  ch = '\r'; break;
+                case 't':  ch = '\t'; break;
+                case 'u':
+                    src++;
+                    if ((ret = __json_parse_unicode(src, &src, dst ? dst + n : buf, &utf8_len)) != JSON_PARSE_OK)
+                        return ret;
+                    n += utf8_len;
+                    continue;
+                default:
+                    return JSON_PARSE_INVALID_STRING_ESCAPE;
+            }
+        } else if (UTF8_VALIDATION && (unsigned char)ch >= 0x80) {
+            if (!(utf8_len = __json_utf8_sequence((const unsigned char*)src, NULL)))
+                return JSON_PARSE_INVALID_UTF8;
+            if (dst)
+                memcpy(dst + n, src, utf8_len);
+            n += utf8_len;
+            src += utf8_len;
+            continue;
+        }
+        if (dst)
+            dst[n] = ch;
+        n++;
+        src++;
     }
-    v->type = JSON_NULL;
+    if (dst)
+        dst[n] = '\0';
+    *len = n;
+    *end = src + 1;
+    return JSON_PARSE_OK;
 }
 
-JSON_TYPE json_type(json_value_t* v) {
-    assert(v != NULL);
-    return v->type;
+static int __json_parse_squote(const char* str, const char** end, json_value_t* v STATS_PARAM) {
+    size_t len;
+    int ret;
+    if ((ret = __json_parse_squote_raw(str + 1, end, NULL, &len)) != JSON_PARSE_OK)
+        return ret;
+    if (len <= JSON_INLINE_MAX) {
+        __json_parse_squote_raw(str + 1, end, v->u.i.s, &len);
+        v->u.i.len = (unsigned char)len;
+        v->flags = JSON_FLAG_INLINE;
+    } else {
+        v->u.s.s = (char*)malloc(len + 1);
+        assert(v->u.s.s);
+        STATS(stats->mallocs++);
+        __json_parse_squote_raw(str + 1, end, v->u.s.s, &len);
+        v->u.s.len = len;
+        v->flags = 0;
+    }
+    v->type = JSON_STRING;
+    STATS(stats->nodes[JSON_STRING]++; stats->string_bytes += len);
+    return JSON_PARSE_OK;
 }
 
-char* json_get_string(const json_value_t* v) {
-    assert(v != NULL && v->type == JSON_STRING);
-    return v->u.s.s;
-}
-size_t json_get_string_length(const json_value_t* v) {
-    assert(v != NULL && v->type == JSON_STRING);
-    return v->u.s.len;
+static int __json_parse_squote_key(const char* str, const char** end, json_member_t* m STATS_PARAM) {
+    int ret;
+    if ((ret = __json_parse_squote_raw(str + 1, end, NULL, &m->klen)) != JSON_PARSE_OK)
+        return ret;
+    m->k = (char*)malloc(m->klen + 1);
+    assert(m->k);
+    STATS(stats->mallocs++);
+    return __json_parse_squote_raw(str + 1, end, m->k, &m->klen);
 }
 
-double json_get_number(const json_value_t* v) {
-    assert(v != NULL && v->type == JSON_NUMBER);
-    return v->u.n;
+static int __json_parse_nonfinite(const char* str, const char** end, json_value_t* v STATS_PARAM) {
+    const char* p = str;
+    if (*p == '-')
+        p++;
+    if (!strncmp(p, "Infinity", 8)) {
+        v->u.n = (*str == '-') ? -HUGE_VAL : HUGE_VAL;
+        *end = p + 8;
+    } else if (p == str && !strncmp(p, "NaN", 3)) {
+        v->u.n = HUGE_VAL;
+        v->u.n -= HUGE_VAL;
+        *end = p + 3;
+    } else {
+        return JSON_PARSE_INVALID_VALUE;
+    }
+    v->type = JSON_NUMBER;
+    STATS(stats->nodes[JSON_NUMBER]++);
+    return JSON_PARSE_OK;
+}
+
+/*
+ * Arrays start out packed and stay that way while every element is a number.
+ * The first element of another type turns the doubles gathered so far into
+ * values in place, from the back, as a value is never smaller than a double.
+ */
+static json_value_t* __json_unpack_numbers(double* nums, size_t size STATS_PARAM) {
+    json_value_t* e;
+    double n;
+    if (!size)
+        return NULL;
+    e = (json_value_t*)realloc(nums, size * sizeof(json_value_t));
+    assert(e);
+    STATS(stats->reallocs++);
+    nums = (double*)e;
+    while (size--) {
+        n = nums[size];
+        json_init(&e[size]);
+        e[size].type = JSON_NUMBER;
+        e[size].u.n = n;
+    }
+    return e;
+}
+
+static bool __json_is_long(double n) {
+    return n >= (double)LONG_MIN && n < -(double)LONG_MIN && (double)(long)n == n && (n != 0.0 || 1.0 / n > 0.0);
+}
+
+/* finish a packed array, narrowed to long[] in place when every number is integral */
+static void __json_pack_numbers(json_value_t* v, double* nums, size_t size, size_t capacity STATS_PARAM) {
+    size_t i;
+    if (capacity != size) {
+        nums = (double*)realloc(nums, size * sizeof(double));
+        assert(nums);
+        STATS(stats->reallocs++);
+    }
+    for (i = 0; i < size && __json_is_long(nums[i]); i++);
+    if (i == size) {
+        for (i = 0; i < size; i++)
+            ((long*)nums)[i] = (long)nums[i];
+        v->flags = JSON_FLAG_PACKED_INT;
+    } else {
+        v->flags = JSON_FLAG_PACKED_DOUBLE;
+    }
+    v->u.p.data = nums;
+    v->u.p.size = size;
+    v->u.p.boxed = NULL;
+}
+
+#define JSON_D_(name, dialect) name##_##dialect
+#define JSON_D__(name, dialect) JSON_D_(name, dialect)
+#define JSON_D(name) JSON_D__(name, JSON_DIALECT)
+
+#define JSON_DIALECT 0
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 1
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 2
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 3
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 4
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 5
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 6
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 7
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 8
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 9
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 10
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 11
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 12
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 13
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 14
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+#define JSON_DIALECT 15
+#include "hadrjson_parse.h"
+#undef JSON_DIALECT
+
+typedef int (*json_parse_fn)(json_value_t* v, const char** str STATS_PARAM);
+
+static const json_parse_fn __json_parse_dialects[JSON_DIALECT_ALL + 1] = {
+    __json_parse_0,  __json_parse_1,  __json_parse_2,  __json_parse_3,
+    __json_parse_4,  __json_parse_5,  __json_parse_6,  __json_parse_7,
+    __json_parse_8,  __json_parse_9,  __json_parse_10, __json_parse_11,
+    __json_parse_12, __json_parse_13, __json_parse_14, __json_parse_15
+};
+
+int json_parse(json_value_t* v, const char* str) {
+    return __json_parse_0(v, &str STATS_NONE);
+}
+
+int json_parse_dialect(json_value_t* v, const char* str, int dialect) {
+    assert(v != NULL);
+    if (dialect & ~JSON_DIALECT_ALL) {
+        json_init(v);
+        return JSON_PARSE_UNKNOWN_DIALECT;
+    }
+    return __json_parse_dialects[dialect](v, &str STATS_NONE);
+}
+
+#ifdef HADRJSON_STATS
+int json_parse_stats(json_value_t* v, const char* str, json_parse_stats_t* stats) {
+    const char* p = str;
+    unsigned long start;
+    int ret;
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(*stats));
+    start = STATS_CYCLES();
+    ret = __json_parse_0(v, &p, stats);
+    stats->total_cycles = STATS_CYCLES() - start;
+    stats->bytes = p - str;
+    return ret;
+}
+#endif
+
+#define JSON_FREE_FRAMES 32
+
+typedef struct {
+    json_value_t* v;    /* array or object whose children are being released */
+    size_t i;
+} json_free_frame_t;
+
+/* inside documents the numbers of a packed array follow their reference count */
+typedef union {
+    long refs;
+    double align;
+} json_doc_numbers_t;
+
+#define DOC_NUMBERS(v) ((json_doc_numbers_t*)(v)->u.p.data - 1)
+
+enum { WALK_FREE, WALK_RELEASE, WALK_ADOPT };
+
+/* drop one holder of shared storage, true when it was the last and the storage must go */
+static int __json_doc_unshare(long* refs) {
+    if (!refs)
+        return 1;
+    if (__sync_sub_and_fetch(refs, 1))
+        return 0;
+    free(refs);
+    return 1;
+}
+
+/* move the numbers behind a reference count */
+static void __json_doc_adopt_numbers(json_value_t* v) {
+    json_doc_numbers_t* n;
+    n = (json_doc_numbers_t*)realloc(v->u.p.data, sizeof(json_doc_numbers_t) + v->u.p.size * sizeof(double));
+    assert(n);
+    memmove(n + 1, n, v->u.p.size * sizeof(double));
+    n->refs = 1;
+    v->u.p.data = n + 1;
+}
+
+/*
+ * Depth first with an explicit stack, so deep trees cannot overflow the C
+ * stack. WALK_FREE frees a plain tree, WALK_RELEASE a document tree whose
+ * shared storage is freed by its last holder only, WALK_ADOPT turns a plain
+ * tree into a document tree that owns all of its storage.
+ */
+static void __json_walk_tree(json_value_t* v, int mode) {
+    json_free_frame_t local[JSON_FREE_FRAMES];
+    json_free_frame_t* stack = local;
+    json_free_frame_t* f;
+    json_value_t* c;
+    long** refs;
+    size_t top = 0, cap = JSON_FREE_FRAMES;
+    c = v;
+    for (;;) {
+        switch (c->type) {
+            case JSON_STRING:
+                if (c->flags & JSON_FLAG_INLINE)
+                    break;
+                if (mode == WALK_ADOPT)
+                    c->u.s.refs = NULL;
+                else if (mode == WALK_FREE || __json_doc_unshare(c->u.s.refs))
+                    free(c->u.s.s);
+                break;
+            case JSON_ARRAY:
+                if (c->flags & JSON_FLAG_PACKED) {
+                    if (mode == WALK_ADOPT) {
+                        __json_doc_adopt_numbers(c);
+                        break;
+                    }
+                    free(c->u.p.boxed);
+                    if (mode == WALK_FREE)
+                        free(c->u.p.data);
+                    else if (!__sync_sub_and_fetch(&DOC_NUMBERS(c)->refs, 1))
+                        free(DOC_NUMBERS(c));
+                    break;
+                }
+                /* fall through */
+            case JSON_OBJECT:
+                refs = c->type == JSON_ARRAY ? &c->u.a.refs : &c->u.o.refs;
+                if (mode == WALK_ADOPT)
+                    *refs = NULL;
+                else if (mode == WALK_RELEASE && !__json_doc_unshare(*refs))
+                    break;
+                if (top == cap) {
+                    cap *= 2;
+                    if (stack == local) {
+                        stack = (json_free_frame_t*)malloc(cap * sizeof(json_free_frame_t));
+                        assert(stack);
+                        memcpy(stack, local, sizeof(local));
+                    } else {
+                        stack = (json_free_frame_t*)realloc(stack, cap * sizeof(json_free_frame_t));
+                        assert(stack);
+                    }
+                }
+                stack[top].v = c;
+                stack[top].i = 0;
+                top++;
+                break;
+            default: break;
+        }
+        c = NULL;
+        while (top && !c) {
+            f = &stack[top - 1];
+            if (f->v->type == JSON_ARRAY) {
+                if (f->i < f->v->u.a.size) {
+                    c = &f->v->u.a.e[f->i++];
+                    continue;
+                }
+                if (mode != WALK_ADOPT)
+                    free(f->v->u.a.e);
+            } else {
+                if (f->i < f->v->u.o.size) {
+                    if (mode != WALK_ADOPT)
+                        free(f->v->u.o.m[f->i].k);
+                    c = &f->v->u.o.m[f->i++].v;
+                    continue;
+                }
+                if (mode != WALK_ADOPT)
+                    free(f->v->u.o.m);
+            }
+            top--;
+        }
+        if (!c)
+            break;
+    }
+    if (stack != local)
+        free(stack);
+}
+
+void json_free(json_value_t* v) {
+    assert(v != NULL);
+    __json_walk_tree(v, WALK_FREE);
+    json_init(v);
+}
+
+#ifndef HADRJSON_NO_THREADS
+#define JSON_FREE_QUEUE 64
+
+enum { RECLAIM_IDLE, RECLAIM_RUNNING, RECLAIM_STOPPING };
+
+/* trees waiting for the reclaimer thread, a ring guarded by lock */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* signalled when a tree is queued or stopping starts */
+    pthread_cond_t room;        /* signalled when a slot frees up or stopping starts */
+    pthread_cond_t idle;        /* signalled when a drain has joined the thread */
+    pthread_t thread;
+    json_value_t queue[JSON_FREE_QUEUE];
+    size_t head, size;
+    int state;
+} __json_reclaimer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void* __json_reclaim(void* arg) {
+    json_value_t v;
+    (void)arg;
+    pthread_mutex_lock(&__json_reclaimer.lock);
+    for (;;) {
+        while (!__json_reclaimer.size && __json_reclaimer.state == RECLAIM_RUNNING)
+            pthread_cond_wait(&__json_reclaimer.ready, &__json_reclaimer.lock);
+        if (!__json_reclaimer.size)
+            break;
+        v = __json_reclaimer.queue[__json_reclaimer.head];
+        __json_reclaimer.head = (__json_reclaimer.head + 1) % JSON_FREE_QUEUE;
+        __json_reclaimer.size--;
+        pthread_cond_signal(&__json_reclaimer.room);
+        pthread_mutex_unlock(&__json_reclaimer.lock);
+        __json_walk_tree(&v, WALK_FREE);
+        pthread_mutex_lock(&__json_reclaimer.lock);
+    }
+    pthread_mutex_unlock(&__json_reclaimer.lock);
+    return NULL;
+}
+#endif
+
+void json_free_deferred(json_value_t* v) {
+#ifndef HADRJSON_NO_THREADS
+    json_value_t tree;
+    assert(v != NULL);
+    if ((v->type != JSON_ARRAY || !json_get_array_size(v)) && (v->type != JSON_OBJECT || !v->u.o.size)) {
+        json_free(v);
+        return;
+    }
+    tree = *v;
+    json_init(v);
+    pthread_mutex_lock(&__json_reclaimer.lock);
+    if (__json_reclaimer.state == RECLAIM_IDLE) {
+        if (!pthread_create(&__json_reclaimer.thread, NULL, __json_reclaim, NULL))
+            __json_reclaimer.state = RECLAIM_RUNNING;
+    }
+    while (__json_reclaimer.size == JSON_FREE_QUEUE && __json_reclaimer.state == RECLAIM_RUNNING)
+        pthread_cond_wait(&__json_reclaimer.room, &__json_reclaimer.lock);
+    if (__json_reclaimer.state != RECLAIM_RUNNING) {
+        /* no thread, or a drain is under way and the thread may already be gone */
+        pthread_mutex_unlock(&__json_reclaimer.lock);
+        __json_walk_tree(&tree, WALK_FREE);
+        return;
+    }
+    __json_reclaimer.queue[(__json_reclaimer.head + __json_reclaimer.size) % JSON_FREE_QUEUE] = tree;
+    __json_reclaimer.size++;
+    pthread_cond_signal(&__json_reclaimer.ready);
+    pthread_mutex_unlock(&__json_reclaimer.lock);
+#else
+    json_free(v);
+#endif
+}
+
+void json_free_drain(void) {
+#ifndef HADRJSON_NO_THREADS
+    pthread_mutex_lock(&__json_reclaimer.lock);
+    if (__json_reclaimer.state == RECLAIM_STOPPING) {
+        /* another drain joins the thread, wait for it to finish */
+        while (__json_reclaimer.state == RECLAIM_STOPPING)
+            pthread_cond_wait(&__json_reclaimer.idle, &__json_reclaimer.lock);
+        pthread_mutex_unlock(&__json_reclaimer.lock);
+        return;
+    }
+    if (__json_reclaimer.state == RECLAIM_IDLE) {
+        pthread_mutex_unlock(&__json_reclaimer.lock);
+        return;
+    }
+    __json_reclaimer.state = RECLAIM_STOPPING;
+    pthread_cond_signal(&__json_reclaimer.ready);
+    pthread_cond_broadcast(&__json_reclaimer.room);
+    pthread_mutex_unlock(&__json_reclaimer.lock);
+    pthread_join(__json_reclaimer.thread, NULL);
+    pthread_mutex_lock(&__json_reclaimer.lock);
+    __json_reclaimer.state = RECLAIM_IDLE;
+    pthread_cond_broadcast(&__json_reclaimer.idle);
+    pthread_mutex_unlock(&__json_reclaimer.lock);
+#endif
+}
+
+struct json_doc_t {
+    long refs;
+    json_value_t root;  /* may share storage with other documents, see __json_doc_share */
+};
+
+int json_doc_parse(json_doc_t** doc, const char* str) {
+    json_doc_t* d;
+    int ret;
+    assert(doc != NULL);
+    d = (json_doc_t*)malloc(sizeof(json_doc_t));
+    assert(d);
+    if ((ret = json_parse(&d->root, str)) != JSON_PARSE_OK) {
+        free(d);
+        *doc = NULL;
+        return ret;
+    }
+    __json_walk_tree(&d->root, WALK_ADOPT);
+    d->refs = 1;
+    *doc = d;
+    return ret;
+}
+
+json_doc_t* json_doc_retain(json_doc_t* doc) {
+    assert(doc != NULL);
+    __sync_add_and_fetch(&doc->refs, 1);
+    return doc;
+}
+
+void json_doc_release(json_doc_t* doc) {
+    if (doc && __sync_sub_and_fetch(&doc->refs, 1) == 0) {
+        __json_walk_tree(&doc->root, WALK_RELEASE);
+        free(doc);
+    }
+}
+
+const json_value_t* json_doc_root(const json_doc_t* doc) {
+    assert(doc != NULL);
+    return &doc->root;
+}
+
+/* index of the member or element seg names, a missing key gets the index past the end */
+static int __json_doc_find(const json_value_t* v, const char* seg, size_t* index) {
+    unsigned long n;
+    char* end;
+    size_t i, len;
+    if (v->type == JSON_OBJECT) {
+        len = strlen(seg);
+        for (i = 0; i < v->u.o.size; i++) {
+            if (v->u.o.m[i].klen == len && !memcmp(v->u.o.m[i].k, seg, len)) {
+                *index = i;
+                return 0;
+            }
+        }
+        *index = v->u.o.size;
+        return -1;
+    }
+    if (v->type != JSON_ARRAY || !ISDIGIT(*seg))
+        return -1;
+    n = strtoul(seg, &end, 10);
+    if (*end != '\0' || n >= json_get_array_size(v))
+        return -1;
+    *index = n;
+    return 0;
+}
+
+json_node_t json_doc_node(json_doc_t* doc, const char* const* path, size_t depth) {
+    json_node_t node;
+    const json_value_t* v;
+    size_t i, index;
+    assert(doc != NULL);
+    node.doc = NULL;
+    node.v = NULL;
+    for (v = &doc->root, i = 0; i < depth; i++) {
+        if (__json_doc_find(v, path[i], &index))
+            return node;
+        v = v->type == JSON_OBJECT ? &v->u.o.m[index].v : json_get_array_element(v, index);
+    }
+    node.doc = json_doc_retain(doc);
+    node.v = v;
+    return node;
+}
+
+void json_node_release(json_node_t* node) {
+    assert(node != NULL);
+    json_doc_release(node->doc);
+    node->doc = NULL;
+    node->v = NULL;
+}
+
+/* one more holder of the storage behind refs, the first share counts the original holder too */
+static long* __json_doc_count(long* const* refs) {
+    long *c, *other;
+    if (!(c = __atomic_load_n(refs, __ATOMIC_ACQUIRE))) {
+        c = (long*)malloc(sizeof(long));
+        assert(c);
+        *c = 2;
+        if (!(other = __sync_val_compare_and_swap((long**)refs, NULL, c)))
+            return c;
+        free(c);
+        c = other;
+    }
+    __sync_add_and_fetch(c, 1);
+    return c;
+}
+
+/* dst holds the same storage as src, a packed array shares the numbers but boxes them on its own */
+static void __json_doc_share(json_value_t* dst, const json_value_t* src) {
+    *dst = *src;
+    switch (src->type) {
+        case JSON_STRING:
+            if (!(src->flags & JSON_FLAG_INLINE))
+                dst->u.s.refs = __json_doc_count(&src->u.s.refs);
+            break;
+        case JSON_ARRAY:
+            if (src->flags & JSON_FLAG_PACKED) {
+                __sync_add_and_fetch(&DOC_NUMBERS(src)->refs, 1);
+                dst->u.p.boxed = NULL;
+            } else if (src->u.a.size) {
+                dst->u.a.refs = __json_doc_count(&src->u.a.refs);
+            }
+            break;
+        case JSON_OBJECT:
+            if (src->u.o.size)
+                dst->u.o.refs = __json_doc_count(&src->u.o.refs);
+            break;
+        default: break;
+    }
+}
+
+/*
+ * Give dst storage of its own with the children of src shared and the keys
+ * copied, except child skip which is left null. extra makes room for members.
+ */
+static void __json_doc_copy(json_value_t* dst, const json_value_t* src, size_t skip, size_t extra) {
+    json_member_t* m;
+    json_value_t* e;
+    size_t i;
+    if (src->type == JSON_OBJECT) {
+        m = (json_member_t*)malloc((src->u.o.size + extra) * sizeof(json_member_t));
+        assert(m);
+        for (i = 0; i < src->u.o.size; i++) {
+            m[i].klen = src->u.o.m[i].klen;
+            m[i].k = (char*)malloc(m[i].klen + 1);
+            assert(m[i].k);
+            memcpy(m[i].k, src->u.o.m[i].k, m[i].klen + 1);
+            if (i == skip)
+                json_init(&m[i].v);
+            else
+                __json_doc_share(&m[i].v, &src->u.o.m[i].v);
+        }
+        dst->u.o.m = m;
+        dst->u.o.size = src->u.o.size;
+        dst->u.o.refs = NULL;
+    } else {
+        i = json_get_array_size(src);
+        e = (json_value_t*)malloc(i * sizeof(json_value_t));
+        assert(e);
+        for (i = 0; i < json_get_array_size(src); i++) {
+            json_init(&e[i]);
+            if (i == skip)
+                continue;
+            if (!(src->flags & JSON_FLAG_PACKED)) {
+                __json_doc_share(&e[i], &src->u.a.e[i]);
+                continue;
+            }
+            /* the copy of a packed array is unpacked */
+            e[i].type = JSON_NUMBER;
+            e[i].u.n = src->flags & JSON_FLAG_PACKED_INT ? (double)((long*)src->u.p.data)[i] : ((double*)src->u.p.data)[i];
+        }
+        dst->u.a.e = e;
+        dst->u.a.size = i;
+        dst->u.a.refs = NULL;
+    }
+    dst->type = src->type;
+    dst->flags = 0;
+}
+
+int json_doc_set(json_doc_t** out, json_doc_t* base, const char* const* path, size_t depth, json_value_t* value) {
+    json_doc_t* d;
+    json_value_t* v;
+    const json_value_t* src;
+    size_t i, index, len;
+    int missing;
+    assert(out != NULL && base != NULL && value != NULL);
+    d = (json_doc_t*)malloc(sizeof(json_doc_t));
+    assert(d);
+    d->refs = 1;
+    json_init(&d->root);
+    for (v = &d->root, src = &base->root, i = 0; i < depth; i++) {
+        missing = __json_doc_find(src, path[i], &index);
+        if ((missing && (src->type != JSON_OBJECT || i + 1 < depth)) || (i + 1 < depth && (src->flags & JSON_FLAG_PACKED))) {
+            json_doc_release(d);
+            *out = NULL;
+            return -1;
+        }
+        __json_doc_copy(v, src, index, missing ? 1 : 0);
+        if (v->type == JSON_ARRAY) {
+            v = &v->u.a.e[index];
+            src = src->flags & JSON_FLAG_PACKED ? NULL : &src->u.a.e[index];
+            continue;
+        }
+        if (missing) {
+            len = strlen(path[i]);
+            v->u.o.m[index].k = (char*)malloc(len + 1);
+            assert(v->u.o.m[index].k);
+            memcpy(v->u.o.m[index].k, path[i], len + 1);
+            v->u.o.m[index].klen = len;
+            json_init(&v->u.o.m[index].v);
+            v->u.o.size++;
+        }
+        v = &v->u.o.m[index].v;
+        src = missing ? NULL : &src->u.o.m[index].v;
+    }
+    __json_walk_tree(value, WALK_ADOPT);
+    *v = *value;
+    json_init(value);
+    *out = d;
+    return 0;
+}
+
+JSON_TYPE json_type(const json_value_t* v) {
+    assert(v != NULL);
+    return v->type;
+}
+
+char* json_get_string(const json_value_t* v) {
+    assert(v != NULL && v->type == JSON_STRING);
+    if (v->flags & JSON_FLAG_INLINE)
+        return (char*)v->u.i.s;
+    return v->u.s.s;
+}
+size_t json_get_string_length(const json_value_t* v) {
+    assert(v != NULL && v->type == JSON_STRING);
+    if (v->flags & JSON_FLAG_INLINE)
+        return v->u.i.len;
+    return v->u.s.len;
+}
+
+double json_get_number(const json_value_t* v) {
+    assert(v != NULL && v->type == JSON_NUMBER);
+    return v->u.n;
 }
 
 size_t json_get_array_size(const json_value_t* v) {
     assert(v != NULL && v->type == JSON_ARRAY);
-    return v->u.a.size;
+    return v->flags & JSON_FLAG_PACKED ? v->u.p.size : v->u.a.size;
 }
 
 json_value_t* json_get_array_element(const json_value_t* v, size_t index) {
+    json_value_t *boxed, *other;
+    size_t i;
     assert(v != NULL && v->type == JSON_ARRAY);
-    assert(index < v->u.a.size);
-    return &v->u.a.e[index];
+    assert(index < json_get_array_size(v));
+    if (!(v->flags & JSON_FLAG_PACKED))
+        return &v->u.a.e[index];
+    /* acquire pairs with the publishing swap, the elements are filled in before it */
+    if (!(boxed = __atomic_load_n(&v->u.p.boxed, __ATOMIC_ACQUIRE))) {
+        /* racing readers of a shared document may both box, the loser frees its copy */
+        boxed = (json_value_t*)malloc(v->u.p.size * sizeof(json_value_t));
+        assert(boxed);
+        for (i = 0; i < v->u.p.size; i++) {
+            json_init(&boxed[i]);
+            boxed[i].type = JSON_NUMBER;
+            boxed[i].u.n = v->flags & JSON_FLAG_PACKED_INT ? (double)((long*)v->u.p.data)[i] : ((double*)v->u.p.data)[i];
+        }
+        if ((other = __sync_val_compare_and_swap(&((json_value_t*)v)->u.p.boxed, NULL, boxed))) {
+            free(boxed);
+            boxed = other;
+        }
+    }
+    return &boxed[index];
+}
+
+int json_get_number_array(const json_value_t* v, const void** data, size_t* size) {
+    assert(v != NULL && v->type == JSON_ARRAY && data != NULL && size != NULL);
+    if (!(v->flags & JSON_FLAG_PACKED))
+        return 0;
+    *data = v->u.p.data;
+    *size = v->u.p.size;
+    return v->flags & JSON_FLAG_PACKED;
 }
 
 size_t json_get_object_size(const json_value_t* v) {
@@ -446,4 +1444,826 @@ json_value_t* json_get_object_value(const json_value_t* v, size_t index) {
     assert(v != NULL && v->type == JSON_OBJECT);
     assert(index < v->u.o.size);
     return &v->u.o.m[index].v;
-}
\ No newline at end of file
+}
+
+#define FORMAT_STACK 16
+
+typedef struct {
+    const char* p;
+    const char* end;
+    char* out;
+    size_t size;        /* room in out, the terminator included */
+    size_t len;
+    int pretty;
+    int indent;
+    size_t depth;
+    /* one bit per open container, set for objects */
+    unsigned char* stack;
+    size_t capacity;
+    unsigned char local[FORMAT_STACK];
+} json_format_t;
+
+#define FORMAT_PEEK(f) ((f)->p < (f)->end ? *(f)->p : '\0')
+
+/* output past the end of out is only counted */
+static void __json_format_put(json_format_t* f, char ch) {
+    if (f->len < f->size)
+        f->out[f->len] = ch;
+    f->len++;
+}
+
+static void __json_format_copy(json_format_t* f, const char* s, size_t n) {
+    if (f->len < f->size)
+        memcpy(f->out + f->len, s, f->size - f->len < n ? f->size - f->len : n);
+    f->len += n;
+}
+
+static void __json_format_whitespace(json_format_t* f) {
+    while (f->p < f->end && is_whitespace(*f->p))
+        f->p++;
+}
+
+static void __json_format_newline(json_format_t* f) {
+    size_t i;
+    if (!f->pretty)
+        return;
+    __json_format_put(f, '\n');
+    for (i = 0; i < f->depth * f->indent; i++)
+        __json_format_put(f, ' ');
+}
+
+static void __json_format_push(json_format_t* f, int object) {
+    if (f->depth == f->capacity * 8) {
+        if (f->stack == f->local) {
+            f->stack = (unsigned char*)malloc(f->capacity * 2);
+            assert(f->stack);
+            memcpy(f->stack, f->local, f->capacity);
+        } else {
+            f->stack = (unsigned char*)realloc(f->stack, f->capacity * 2);
+            assert(f->stack);
+        }
+        f->capacity *= 2;
+    }
+    if (object)
+        f->stack[f->depth / 8] |= (unsigned char)(1 << (f->depth % 8));
+    else
+        f->stack[f->depth / 8] &= (unsigned char)~(1 << (f->depth % 8));
+    f->depth++;
+}
+
+#define FORMAT_IN_OBJECT(f) ((f)->stack[((f)->depth - 1) / 8] & (1 << (((f)->depth - 1) % 8)))
+
+static int __json_format_literal(json_format_t* f, const char* literal) {
+    size_t len;
+    len = strlen(literal);
+    if ((size_t)(f->end - f->p) < len || strncmp(f->p, literal, len))
+        return JSON_PARSE_INVALID_VALUE;
+    __json_format_copy(f, f->p, len);
+    f->p += len;
+    return JSON_PARSE_OK;
+}
+
+static int __json_format_number(json_format_t* f) {
+    const char* p;
+    int ret;
+    if ((ret = __json_scan_number(f->p, f->end, &p)) != JSON_PARSE_OK)
+        return ret;
+    __json_format_copy(f, f->p, p - f->p);
+    f->p = p;
+    return JSON_PARSE_OK;
+}
+
+
+static int __json_format_string(json_format_t* f) {
+    const char* p;
+    int ret;
+    if ((ret = __json_scan_string(f->p, f->end, &p)) != JSON_PARSE_OK)
+        return ret;
+    __json_format_copy(f, f->p, p - f->p);
+    f->p = p;
+    return JSON_PARSE_OK;
+}
+
+static int __json_format_key(json_format_t* f) {
+    int ret;
+    if (FORMAT_PEEK(f) != '\"')
+        return JSON_PARSE_MISS_KEY;
+    if ((ret = __json_format_string(f)) != JSON_PARSE_OK)
+        return ret;
+    __json_format_whitespace(f);
+    if (FORMAT_PEEK(f) != ':')
+        return JSON_PARSE_MISS_COLON;
+    f->p++;
+    __json_format_whitespace(f);
+    __json_format_put(f, ':');
+    if (f->pretty)
+        __json_format_put(f, ' ');
+    return JSON_PARSE_OK;
+}
+
+/*
+ * A loop instead of recursion, the kind of every open container is one bit
+ * of f->stack, so nesting costs a bit per level and no C stack.
+ */
+static int __json_format_value(json_format_t* f) {
+    int ret, object;
+    for (;;) {
+        switch (FORMAT_PEEK(f)) {
+            case 'n':  ret = __json_format_literal(f, "null"); break;
+            case 't':  ret = __json_format_literal(f, "true"); break;
+            case 'f':  ret = __json_format_literal(f, "false"); break;
+            case '"':  ret = __json_format_string(f); break;
+            case '[':
+            case '{':
+                object = *f->p++ == '{';
+                __json_format_whitespace(f);
+                __json_format_put(f, object ? '{' : '[');
+                if (FORMAT_PEEK(f) == (object ? '}' : ']')) {
+                    f->p++;
+                    __json_format_put(f, object ? '}' : ']');
+                    ret = JSON_PARSE_OK;
+                    break;
+                }
+                __json_format_push(f, object);
+                __json_format_newline(f);
+                if (object && (ret = __json_format_key(f)) != JSON_PARSE_OK)
+                    return ret;
+                continue;
+            default:   ret = __json_format_number(f); break;
+            case '\0': return JSON_PARSE_EXPECT_VALUE;
+        }
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        /* the value is done, close the containers it completes */
+        for (;;) {
+            if (!f->depth)
+                return JSON_PARSE_OK;
+            object = FORMAT_IN_OBJECT(f);
+            __json_format_whitespace(f);
+            if (FORMAT_PEEK(f) == ',') {
+                f->p++;
+                __json_format_whitespace(f);
+                if (!object && FORMAT_PEEK(f) == '\0')
+                    return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                __json_format_put(f, ',');
+                __json_format_newline(f);
+                if (object && (ret = __json_format_key(f)) != JSON_PARSE_OK)
+                    return ret;
+                break;
+            }
+            if (FORMAT_PEEK(f) != (object ? '}' : ']'))
+                return object ? JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET : JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+            f->p++;
+            f->depth--;
+            __json_format_newline(f);
+            __json_format_put(f, object ? '}' : ']');
+        }
+    }
+}
+
+static int __json_format(const char* in, size_t len, char* out, size_t size, size_t* outlen, int pretty, int indent) {
+    json_format_t f;
+    int ret;
+    assert(in != NULL);
+    f.p = in;
+    f.end = in + len;
+    f.out = out;
+    /* the last byte is kept for the terminator */
+    f.size = out && size ? size - 1 : 0;
+    f.len = 0;
+    f.pretty = pretty;
+    f.indent = indent;
+    f.depth = 0;
+    f.stack = f.local;
+    f.capacity = FORMAT_STACK;
+    __json_format_whitespace(&f);
+    if ((ret = __json_format_value(&f)) == JSON_PARSE_OK) {
+        __json_format_whitespace(&f);
+        if (f.p != f.end)
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+    }
+    if (f.stack != f.local)
+        free(f.stack);
+    if (out && size)
+        out[f.len < f.size ? f.len : f.size] = '\0';
+    if (out && ret == JSON_PARSE_OK && f.len > f.size)
+        ret = JSON_PARSE_BUFFER_TOO_SMALL;
+    if (outlen)
+        *outlen = f.len;
+    return ret;
+}
+
+int json_validate_utf8(const char* str, size_t len) {
+    assert(str != NULL);
+    return __json_validate_utf8((const unsigned char*)str, len);
+}
+
+int json_minify(const char* in, size_t len, char* out, size_t size, size_t* outlen) {
+    return __json_format(in, len, out, size, outlen, 0, 0);
+}
+
+int json_prettify(const char* in, size_t len, char* out, size_t size, size_t* outlen, int indent) {
+    assert(indent >= 0);
+    return __json_format(in, len, out, size, outlen, 1, indent);
+}
+
+
+static int __json_skip_value(const char* str, const char** end);
+
+static int __json_skip_array(const char* str, const char** end) {
+    int ret;
+    str++;
+    while (is_whitespace(*str))
+        str++;
+    if (*str == ']') {
+        *end = str + 1;
+        return JSON_PARSE_OK;
+    }
+    for (;;) {
+        if ((ret = __json_skip_value(str, &str)) != JSON_PARSE_OK)
+            return ret;
+        while (is_whitespace(*str))
+            str++;
+        if (*str == ',') {
+            str++;
+            while (is_whitespace(*str))
+                str++;
+            if (*str == '\0')
+                return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+        } else if (*str == ']') {
+            *end = str + 1;
+            return JSON_PARSE_OK;
+        } else {
+            return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+        }
+    }
+}
+
+static int __json_skip_object(const char* str, const char** end) {
+    int ret;
+    str++;
+    while (is_whitespace(*str))
+        str++;
+    if (*str == '}') {
+        *end = str + 1;
+        return JSON_PARSE_OK;
+    }
+    for (;;) {
+        if (*str != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if ((ret = __json_scan_string(str, NULL, &str)) != JSON_PARSE_OK)
+            return ret;
+        while (is_whitespace(*str))
+            str++;
+        if (*str != ':')
+            return JSON_PARSE_MISS_COLON;
+        str++;
+        while (is_whitespace(*str))
+            str++;
+        if ((ret = __json_skip_value(str, &str)) != JSON_PARSE_OK)
+            return ret;
+        while (is_whitespace(*str))
+            str++;
+        if (*str == ',') {
+            str++;
+            while (is_whitespace(*str))
+                str++;
+        } else if (*str == '}') {
+            *end = str + 1;
+            return JSON_PARSE_OK;
+        } else {
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+        }
+    }
+}
+
+/* validate a value and step over it without allocating or decoding anything */
+static int __json_skip_value(const char* str, const char** end) {
+    json_value_t v;
+    switch (*str) {
+        case 'n':  return __json_parse_literal(str, end, "null", JSON_NULL, &v STATS_NONE);
+        case 't':  return __json_parse_literal(str, end, "true", JSON_TRUE, &v STATS_NONE);
+        case 'f':  return __json_parse_literal(str, end, "false", JSON_FALSE, &v STATS_NONE);
+        case '"':  return __json_scan_string(str, NULL, end);
+        case '[':  return __json_skip_array(str, end);
+        case '{':  return __json_skip_object(str, end);
+        default:   return __json_scan_number(str, NULL, end);
+        case '\0': return JSON_PARSE_EXPECT_VALUE;
+    }
+}
+
+static unsigned long __json_bind_hash(const char* key, size_t len, unsigned int seed) {
+    unsigned long h = (2166136261UL ^ (seed * 0x9E3779B9UL)) & 0xFFFFFFFFUL;
+    while (len--) {
+        h ^= *(unsigned char*)key++;
+        h = (h * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return h;
+}
+
+#define BIND_BUCKET(h) (((h) >> 16) & (JSON_BIND_BUCKETS - 1))
+#define BIND_SLOT(h, d) (((((h) ^ ((d) * 0x9E3779B9UL)) * 0x85EBCA6BUL) & 0xFFFFFFFFUL) % JSON_BIND_SLOTS)
+/* hash seeds tried before falling back to a sorted table */
+#define BIND_SEEDS 32
+#define BIND_HASHED 1
+#define BIND_SORTED 2
+
+/*
+ * Hash and displace: keys are grouped into buckets by one part of the hash,
+ * then every bucket, largest first, searches for a displacement that moves
+ * all of its keys into free slots. A lookup is one hash, two table reads and
+ * a single key compare.
+ */
+static int __json_bind_displace(json_bind_desc_t* d, unsigned int seed) {
+    unsigned long h[JSON_BIND_SLOTS];
+    size_t count[JSON_BIND_BUCKETS];
+    unsigned char taken[JSON_BIND_SLOTS];
+    size_t i, j, b, size, max = 0;
+    unsigned int disp;
+    memset(d->slots, 0, sizeof(d->slots));
+    memset(d->disp, 0, sizeof(d->disp));
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < d->size; i++) {
+        h[i] = __json_bind_hash(d->fields[i].key, d->klens[i], seed);
+        if (++count[BIND_BUCKET(h[i])] > max)
+            max = count[BIND_BUCKET(h[i])];
+    }
+    for (size = max; size > 0; size--) {
+        for (b = 0; b < JSON_BIND_BUCKETS; b++) {
+            if (count[b] != size)
+                continue;
+            for (disp = 0; disp < 256; disp++) {
+                memset(taken, 0, sizeof(taken));
+                for (i = 0; i < d->size; i++) {
+                    if (BIND_BUCKET(h[i]) != b)
+                        continue;
+                    j = BIND_SLOT(h[i], disp);
+                    if (d->slots[j] || taken[j])
+                        break;
+                    taken[j] = (unsigned char)(i + 1);
+                }
+                if (i == d->size)
+                    break;
+            }
+            if (disp == 256)
+                return -1;
+            d->disp[b] = (unsigned char)disp;
+            for (j = 0; j < JSON_BIND_SLOTS; j++)
+                if (taken[j])
+                    d->slots[j] = taken[j];
+        }
+    }
+    return 0;
+}
+
+/* any total order will do for the sorted table, shorter keys first is the cheapest */
+static int __json_bind_compare(const char* a, size_t alen, const char* b, size_t blen) {
+    if (alen != blen)
+        return alen < blen ? -1 : 1;
+    return memcmp(a, b, alen);
+}
+
+int json_bind_compile(json_bind_desc_t* d) {
+    const json_bind_field_t* f;
+    unsigned int seed;
+    unsigned char t;
+    size_t i, j;
+    assert(d != NULL);
+    if (d->size >= JSON_BIND_SLOTS)
+        return -1;
+    for (i = 0; i < d->size; i++) {
+        f = &d->fields[i];
+        if (f->type == JSON_BIND_OBJECT && (!f->nested || json_bind_compile(f->nested)))
+            return -1;
+        d->klens[i] = strlen(f->key);
+    }
+    for (seed = 0; seed < BIND_SEEDS; seed++) {
+        if (!__json_bind_displace(d, seed)) {
+            d->seed = (unsigned char)seed;
+            d->compiled = BIND_HASHED;
+            return 0;
+        }
+    }
+    /* no perfect hash, keep the field indexes sorted by key for a binary search */
+    memset(d->slots, 0, sizeof(d->slots));
+    for (i = 0; i < d->size; i++) {
+        t = (unsigned char)(i + 1);
+        f = &d->fields[i];
+        for (j = i; j > 0 && __json_bind_compare(f->key, d->klens[i],
+            d->fields[d->slots[j - 1] - 1].key, d->klens[d->slots[j - 1] - 1]) < 0; j--)
+            d->slots[j] = d->slots[j - 1];
+        d->slots[j] = t;
+    }
+    d->compiled = BIND_SORTED;
+    return 0;
+}
+
+static const json_bind_field_t* __json_bind_lookup(const json_bind_desc_t* d, const char* key, size_t klen) {
+    const json_bind_field_t* f;
+    unsigned long h;
+    unsigned char i;
+    size_t lo, hi, mid;
+    int c;
+    if (d->compiled == BIND_SORTED) {
+        for (lo = 0, hi = d->size; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            f = &d->fields[d->slots[mid] - 1];
+            if (!(c = __json_bind_compare(key, klen, f->key, d->klens[d->slots[mid] - 1])))
+                return f;
+            if (c < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return NULL;
+    }
+    h = __json_bind_hash(key, klen, d->seed);
+    i = d->slots[BIND_SLOT(h, d->disp[BIND_BUCKET(h)])];
+    if (!i)
+        return NULL;
+    f = &d->fields[i - 1];
+    if (d->klens[i - 1] != klen || memcmp(f->key, key, klen))
+        return NULL;
+    return f;
+}
+
+static int __json_scan_key(const char* str, const char** end, const char** key, size_t* klen, char** decoded) {
+    const char* p = str + 1;
+    size_t n;
+    int ret = JSON_PARSE_OK;
+    *decoded = NULL;
+    for (;;) {
+#ifdef JSON_SKIP_SIMD
+        if (p - str > 16) {
+            p = __json_find_special_utf8(p, NULL, &ret);
+            if (ret != JSON_PARSE_OK)
+                return ret;
+        }
+#endif
+        if (*p == '\"')
+            break;
+        if (*p == '\\') {
+            /* only escaped keys are decoded, into a temporary copy */
+            *klen = 0;
+            if ((ret = __json_parse_string_common(str, end, klen, decoded STATS_NONE)) != JSON_PARSE_OK) {
+                *decoded = NULL;
+                return ret;
+            }
+            *key = *decoded;
+            return JSON_PARSE_OK;
+        }
+        if (*p == '\0')
+            return JSON_PARSE_MISS_QUOTATION_MARK;
+        if (*(unsigned char*)p < 0x20)
+            return JSON_PARSE_INVALID_STRING_CHAR;
+        if (UTF8_VALIDATION && *(unsigned char*)p >= 0x80) {
+            if (!(n = __json_utf8_sequence((const unsigned char*)p, NULL)))
+                return JSON_PARSE_INVALID_UTF8;
+            p += n;
+        } else {
+            p++;
+        }
+    }
+    *key = str + 1;
+    *klen = p - str - 1;
+    *end = p + 1;
+    return JSON_PARSE_OK;
+}
+
+static int __json_bind_object(const json_bind_desc_t* d, char* base, const char* str, const char** end);
+
+static int __json_bind_field(const json_bind_field_t* f, char* dst, const char* str, const char** end) {
+    json_value_t v;
+    char* s;
+    size_t len;
+    int ret;
+    if (*str == 'n')
+        return __json_parse_literal(str, end, "null", JSON_NULL, &v STATS_NONE);
+    switch (f->type) {
+        case JSON_BIND_BOOL:
+            if (*str == 't' || *str == 'f') {
+                if ((ret = __json_parse_literal(str, end, *str == 't' ? "true" : "false", JSON_TRUE, &v STATS_NONE)) == JSON_PARSE_OK)
+                    *(int*)dst = (*str == 't');
+                return ret;
+            }
+            break;
+        case JSON_BIND_INT:
+        case JSON_BIND_DOUBLE:
+            if (*str == '-' || ISDIGIT(*str)) {
+                if ((ret = __json_parse_number(str, end, &v STATS_NONE)) != JSON_PARSE_OK)
+                    return ret;
+                if (f->type == JSON_BIND_DOUBLE) {
+                    *(double*)dst = v.u.n;
+                    return JSON_PARSE_OK;
+                }
+                if (v.u.n < (double)LONG_MIN || v.u.n >= -(double)LONG_MIN || (double)(long)v.u.n != v.u.n)
+                    return JSON_PARSE_BIND_TYPE_MISMATCH;
+                *(long*)dst = (long)v.u.n;
+                return JSON_PARSE_OK;
+            }
+            break;
+        case JSON_BIND_STRING:
+            if (*str == '\"') {
+                len = 0;
+                if ((ret = __json_parse_string_common(str, end, &len, &s STATS_NONE)) != JSON_PARSE_OK)
+                    return ret;
+                free(*(char**)dst);
+                *(char**)dst = s;
+                return JSON_PARSE_OK;
+            }
+            break;
+        case JSON_BIND_OBJECT:
+            if (*str == '{')
+                return __json_bind_object(f->nested, dst, str, end);
+            break;
+    }
+    return *str == '\0' ? JSON_PARSE_EXPECT_VALUE : JSON_PARSE_BIND_TYPE_MISMATCH;
+}
+
+static int __json_bind_object(const json_bind_desc_t* d, char* base, const char* str, const char** end) {
+    const json_bind_field_t* f;
+    const char* key;
+    char* decoded;
+    size_t klen;
+    int ret;
+    str++;
+    while (is_whitespace(*str))
+        str++;
+    if (*str == '}') {
+        *end = str + 1;
+        return JSON_PARSE_OK;
+    }
+    for (;;) {
+        if (*str != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if ((ret = __json_scan_key(str, &str, &key, &klen, &decoded)) != JSON_PARSE_OK)
+            return ret;
+        f = __json_bind_lookup(d, key, klen);
+        free(decoded);
+        while (is_whitespace(*str))
+            str++;
+        if (*str != ':')
+            return JSON_PARSE_MISS_COLON;
+        str++;
+        while (is_whitespace(*str))
+            str++;
+        if (f)
+            ret = __json_bind_field(f, base + f->offset, str, &str);
+        else
+            ret = __json_skip_value(str, &str);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        while (is_whitespace(*str))
+            str++;
+        if (*str == ',') {
+            str++;
+            while (is_whitespace(*str))
+                str++;
+        } else if (*str == '}') {
+            *end = str + 1;
+            return JSON_PARSE_OK;
+        } else {
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+        }
+    }
+}
+
+int json_bind_parse(const json_bind_desc_t* d, void* out, const char* str) {
+    int ret;
+    assert(d != NULL && d->compiled && out != NULL);
+    while (is_whitespace(*str))
+        str++;
+    if (*str != '{')
+        return *str == '\0' ? JSON_PARSE_EXPECT_VALUE : JSON_PARSE_BIND_TYPE_MISMATCH;
+    if ((ret = __json_bind_object(d, (char*)out, str, &str)) == JSON_PARSE_OK) {
+        while (is_whitespace(*str))
+            str++;
+        if (*str != '\0')
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+    }
+    return ret;
+}
+
+void json_bind_free(const json_bind_desc_t* d, void* out) {
+    size_t i;
+    char* base = (char*)out;
+    assert(d != NULL && out != NULL);
+    for (i = 0; i < d->size; i++) {
+        switch (d->fields[i].type) {
+            case JSON_BIND_STRING:
+                free(*(char**)(base + d->fields[i].offset));
+                *(char**)(base + d->fields[i].offset) = NULL;
+                break;
+            case JSON_BIND_OBJECT:
+                json_bind_free(d->fields[i].nested, base + d->fields[i].offset);
+                break;
+            default: break;
+        }
+    }
+}
+
+/*
+ * Projection: active has a bit for every path still alive at this level and
+ * pos[i] is how far path i has been matched. A path matched to its end keeps
+ * the whole value, objects keep only the members some path continues into.
+ * A scalar where a path still goes on is skipped and *kept cleared.
+ */
+static int __json_project_value(const char* const* paths, size_t npaths, const char* str, const char** end,
+    json_value_t* v, unsigned long active, const size_t* pos, int* kept);
+
+static int __json_project_array(const char* const* paths, size_t npaths, const char* str, const char** end,
+    json_value_t* v, unsigned long active, const size_t* pos) {
+    json_value_t e;
+    size_t i, size = 0;
+    int ret = JSON_PARSE_OK, kept;
+    str++;
+    while (is_whitespace(*str))
+        str++;
+    v->u.a.e = NULL;
+    if (*str == ']') {
+        *end = str + 1;
+        v->type = JSON_ARRAY;
+        v->u.a.size = 0;
+        return ret;
+    }
+    for (;;) {
+        json_init(&e);
+        if ((ret = __json_project_value(paths, npaths, str, &str, &e, active, pos, &kept)) != JSON_PARSE_OK)
+            break;
+        if (kept) {
+            size++;
+            v->u.a.e = (json_value_t*)realloc(v->u.a.e, size * sizeof(json_value_t));
+            memcpy(v->u.a.e + size - 1, &e, sizeof(json_value_t));
+        }
+        while (is_whitespace(*str))
+            str++;
+        if (*str == ',') {
+            str++;
+            while (is_whitespace(*str))
+                str++;
+            if (*str == '\0') {
+                ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                break;
+            }
+        } else if (*str == ']') {
+            *end = str + 1;
+            v->type = JSON_ARRAY;
+            v->u.a.size = size;
+            break;
+        } else {
+            ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+            break;
+        }
+    }
+    if (ret != JSON_PARSE_OK) {
+        for (i = 0; i < size; i++)
+            json_free(&v->u.a.e[i]);
+        free(v->u.a.e);
+        v->type = JSON_NULL;
+    }
+    return ret;
+}
+
+static int __json_project_object(const char* const* paths, size_t npaths, const char* str, const char** end,
+    json_value_t* v, unsigned long active, const size_t* pos) {
+    size_t next[JSON_PROJECT_MAX_PATHS];
+    json_member_t m;
+    const char* key;
+    const char* seg;
+    char* decoded;
+    unsigned long match;
+    size_t i, n, klen, size = 0;
+    int ret = JSON_PARSE_OK, kept;
+    str++;
+    while (is_whitespace(*str))
+        str++;
+    v->u.o.m = NULL;
+    if (*str == '}') {
+        *end = str + 1;
+        v->type = JSON_OBJECT;
+        v->u.o.size = 0;
+        return ret;
+    }
+    for (;;) {
+        __json_init_member(&m);
+        if (*str != '\"') {
+            ret = JSON_PARSE_MISS_KEY;
+            break;
+        }
+        if ((ret = __json_scan_key(str, &str, &key, &klen, &decoded)) != JSON_PARSE_OK)
+            break;
+        match = 0;
+        for (i = 0; i < npaths; i++) {
+            if (!(active & (1UL << i)))
+                continue;
+            seg = paths[i] + pos[i];
+            n = strcspn(seg, ".");
+            if (n == klen && !memcmp(seg, key, klen)) {
+                match |= 1UL << i;
+                next[i] = pos[i] + n + (seg[n] == '.');
+            }
+        }
+        if (match) {
+            if (decoded) {
+                m.k = decoded;
+            } else {
+                m.k = (char*)malloc(klen + 1);
+                assert(m.k);
+                memcpy(m.k, key, klen);
+                m.k[klen] = '\0';
+            }
+            m.klen = klen;
+        } else {
+            free(decoded);
+        }
+        while (is_whitespace(*str))
+            str++;
+        if (*str != ':') {
+            ret = JSON_PARSE_MISS_COLON;
+            break;
+        }
+        str++;
+        while (is_whitespace(*str))
+            str++;
+        if (!match) {
+            if ((ret = __json_skip_value(str, &str)) != JSON_PARSE_OK)
+                break;
+        } else {
+            if ((ret = __json_project_value(paths, npaths, str, &str, &m.v, match, next, &kept)) != JSON_PARSE_OK)
+                break;
+            if (kept) {
+                size++;
+                v->u.o.m = (json_member_t*)realloc(v->u.o.m, size * sizeof(json_member_t));
+                memcpy(v->u.o.m + size - 1, &m, sizeof(json_member_t));
+            } else {
+                free(m.k);
+            }
+            m.k = NULL;
+        }
+        while (is_whitespace(*str))
+            str++;
+        if (*str == ',') {
+            str++;
+            while (is_whitespace(*str))
+                str++;
+        } else if (*str == '}') {
+            *end = str + 1;
+            v->type = JSON_OBJECT;
+            v->u.o.size = size;
+            break;
+        } else {
+            ret = JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+            break;
+        }
+    }
+    if (ret != JSON_PARSE_OK) {
+        for (i = 0; i < size; i++) {
+            free(v->u.o.m[i].k);
+            json_free(&v->u.o.m[i].v);
+        }
+        free(v->u.o.m);
+        free(m.k);
+        v->type = JSON_NULL;
+    }
+    return ret;
+}
+
+static int __json_project_value(const char* const* paths, size_t npaths, const char* str, const char** end,
+    json_value_t* v, unsigned long active, const size_t* pos, int* kept) {
+    size_t i;
+    *kept = 1;
+    for (i = 0; i < npaths; i++)
+        if ((active & (1UL << i)) && paths[i][pos[i]] == '\0')
+            return __json_parse_value_0(str, end, v STATS_NONE DEPTH_ARG(0));
+    switch (*str) {
+        case '[':  return __json_project_array(paths, npaths, str, end, v, active, pos);
+        case '{':  return __json_project_object(paths, npaths, str, end, v, active, pos);
+        default:
+            *kept = 0;
+            return __json_skip_value(str, end);
+    }
+}
+
+int json_parse_project(json_value_t* v, const char* str, const char* const* paths, size_t npaths) {
+    size_t pos[JSON_PROJECT_MAX_PATHS];
+    unsigned long active = 0;
+    size_t i;
+    int ret, kept;
+    assert(v != NULL && npaths <= JSON_PROJECT_MAX_PATHS);
+    for (i = 0; i < npaths; i++) {
+        pos[i] = 0;
+        active |= 1UL << i;
+    }
+    json_init(v);
+    while (is_whitespace(*str))
+        str++;
+    if ((ret = __json_project_value(paths, npaths, str, &str, v, active, pos, &kept)) == JSON_PARSE_OK) {
+        while (is_whitespace(*str))
+            str++;
+        if (*str != '\0') {
+            json_free(v);
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        }
+    }
+    return ret;
+}
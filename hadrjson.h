@@ -27,20 +27,36 @@ enum {
     JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET,
     JSON_PARSE_MISS_KEY,
     JSON_PARSE_MISS_COLON,
-    JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET
+    JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET,
+    JSON_PARSE_INVALID_UTF8,
+    JSON_PARSE_BIND_TYPE_MISMATCH,
+    JSON_PARSE_BUFFER_TOO_SMALL,
+    JSON_PARSE_UNKNOWN_DIALECT
 };
 
 typedef struct json_member_t json_member_t;
 typedef struct json_value_t json_value_t;
 
+/* strings up to this length live inside the value, with their terminator and length byte */
+#define JSON_INLINE_MAX (3 * sizeof(size_t) - 2)
+
+#define JSON_FLAG_INLINE 0x01
+#define JSON_FLAG_PACKED_DOUBLE 0x04 /* array of numbers stored as double[] */
+#define JSON_FLAG_PACKED_INT 0x08    /* array of integral numbers stored as long[] */
+#define JSON_FLAG_PACKED (JSON_FLAG_PACKED_DOUBLE | JSON_FLAG_PACKED_INT)
+
+/* inside documents refs counts the values sharing s, e or m, NULL while there is one */
 struct json_value_t {
     union {
         double n;
-        struct { char* s; size_t len; } s;
-        struct { json_value_t*  e; size_t size, capacity; } a;
-        struct { json_member_t* m; size_t size, capacity; } o;
+        struct { char* s; size_t len; long* refs; } s;
+        struct { char s[JSON_INLINE_MAX + 1]; unsigned char len; } i;
+        struct { json_value_t*  e; size_t size; long* refs; } a;
+        struct { void* data; size_t size; json_value_t* boxed; } p;  /* boxed is built on demand */
+        struct { json_member_t* m; size_t size; long* refs; } o;
     } u;
     JSON_TYPE type;
+    unsigned char flags;
 };
 
 struct json_member_t {
@@ -49,11 +65,146 @@ struct json_member_t {
     json_value_t v;
 };
 
-#define json_init(v) do { (v)->type = JSON_NULL; } while(0)
+typedef enum {
+    JSON_BIND_BOOL = 1, /* int */
+    JSON_BIND_INT,      /* long, the number must be integral */
+    JSON_BIND_DOUBLE,   /* double */
+    JSON_BIND_STRING,   /* char*, allocated, released by json_bind_free */
+    JSON_BIND_OBJECT    /* embedded struct described by nested */
+} JSON_BIND_TYPE;
+
+#define JSON_BIND_SLOTS 64
+#define JSON_BIND_BUCKETS 16
+
+typedef struct json_bind_desc_t json_bind_desc_t;
+
+typedef struct {
+    const char* key;
+    JSON_BIND_TYPE type;
+    size_t offset;
+    json_bind_desc_t* nested;
+} json_bind_field_t;
+
+struct json_bind_desc_t {
+    const json_bind_field_t* fields;
+    size_t size;
+    /* perfect hash of the keys, or the fields sorted by key, filled in by json_bind_compile */
+    int compiled;
+    unsigned char seed;
+    unsigned char disp[JSON_BIND_BUCKETS];
+    unsigned char slots[JSON_BIND_SLOTS];
+    size_t klens[JSON_BIND_SLOTS];      /* strlen of each field key */
+};
+
+#define JSON_BIND_FIELD(key, type, s, member, nested) { key, type, offsetof(s, member), nested }
+#define JSON_BIND_DESC(fields) { fields, sizeof(fields) / sizeof(fields[0]), 0, 0, { 0 }, { 0 }, { 0 } }
+
+#ifdef HADRJSON_STATS
+typedef struct {
+    size_t bytes;                   /* input consumed, including trailing whitespace */
+    size_t nodes[JSON_OBJECT + 1];  /* indexed by JSON_TYPE */
+    size_t max_depth;
+    size_t string_bytes;            /* decoded string values */
+    size_t key_bytes;               /* decoded object keys */
+    size_t escapes;
+    size_t mallocs;
+    size_t reallocs;
+    unsigned long total_cycles;
+    unsigned long string_cycles;    /* scanning, allocating and decoding strings and keys */
+    unsigned long number_cycles;    /* scanning and converting numbers */
+} json_parse_stats_t;
+#endif
+
+#define json_init(v) do { (v)->type = JSON_NULL; (v)->flags = 0; } while(0)
 int json_parse(json_value_t* v, const char* str);
+
+/* relaxed input, every combination of these bits has its own specialized parser */
+#define JSON_DIALECT_COMMENTS        0x01   /* // line and block comments */
+#define JSON_DIALECT_TRAILING_COMMAS 0x02   /* [1,2,] and {"a":1,} */
+#define JSON_DIALECT_NONFINITE       0x04   /* NaN, Infinity and -Infinity */
+#define JSON_DIALECT_SINGLE_QUOTES   0x08   /* 'strings' and 'keys' */
+#define JSON_DIALECT_ALL             0x0F
+/* bits outside JSON_DIALECT_ALL give JSON_PARSE_UNKNOWN_DIALECT */
+int json_parse_dialect(json_value_t* v, const char* str, int dialect);
+#ifdef HADRJSON_STATS
+/* json_parse that also fills stats, cycles come from rdtsc on x86 and clock() elsewhere */
+int json_parse_stats(json_value_t* v, const char* str, json_parse_stats_t* stats);
+#endif
 void json_free(json_value_t* v);
 
-JSON_TYPE json_type(json_value_t* v);
+/*
+ * Detach the tree from v in O(1), v is left null, and let a background thread
+ * free it. The thread starts on first use and its queue is bounded, a caller
+ * that outruns it waits for room. json_free_drain frees whatever is still
+ * queued and stops the thread, call it before exit. Built with
+ * HADRJSON_NO_THREADS both are plain synchronous frees.
+ */
+void json_free_deferred(json_value_t* v);
+void json_free_drain(void);
+
+/*
+ * Immutable documents shared between threads. The reference count is atomic,
+ * the last json_doc_release frees the tree. A node handle retains the
+ * document it points into. A path is a list of object keys and decimal array
+ * indexes, json_doc_set returns a new document where only the containers on
+ * the path are copied and everything else is shared with the base document.
+ * Shared strings and containers are reference counted on their own, a value
+ * an edit replaced is freed once no live document still holds it. It takes
+ * value over on success and returns -1 when the path does not exist, the
+ * last key of an object path may be new.
+ */
+typedef struct json_doc_t json_doc_t;
+
+typedef struct {
+    json_doc_t* doc;        /* NULL for a path that was not found */
+    const json_value_t* v;
+} json_node_t;
+
+int json_doc_parse(json_doc_t** doc, const char* str);
+json_doc_t* json_doc_retain(json_doc_t* doc);
+void json_doc_release(json_doc_t* doc);
+const json_value_t* json_doc_root(const json_doc_t* doc);
+json_node_t json_doc_node(json_doc_t* doc, const char* const* path, size_t depth);
+void json_node_release(json_node_t* node);
+int json_doc_set(json_doc_t** out, json_doc_t* base, const char* const* path, size_t depth, json_value_t* value);
+
+/* string contents are checked to be utf-8 unless built with HADRJSON_NO_UTF8_VALIDATION */
+int json_validate_utf8(const char* str, size_t len);
+
+/*
+ * Reformat without building a tree. At most size bytes are written to out,
+ * always terminated, and *outlen gets the full length without terminator.
+ * A valid input that does not fit returns JSON_PARSE_BUFFER_TOO_SMALL.
+ * out may be NULL to only measure the result, minify never needs more than
+ * len + 1 bytes.
+ */
+int json_minify(const char* in, size_t len, char* out, size_t size, size_t* outlen);
+int json_prettify(const char* in, size_t len, char* out, size_t size, size_t* outlen, int indent);
+
+/*
+ * Fill a struct straight from an object without building json_value_t nodes.
+ * Members missing from the input or set to null are left untouched, unknown
+ * keys are validated and skipped. Zero the struct before the first parse so
+ * json_bind_free can release its strings, also after a failed parse.
+ * json_bind_compile takes up to JSON_BIND_SLOTS - 1 fields per struct and
+ * returns -1 for more, or for a JSON_BIND_OBJECT field without nested.
+ */
+int json_bind_compile(json_bind_desc_t* d);
+int json_bind_parse(const json_bind_desc_t* d, void* out, const char* str);
+void json_bind_free(const json_bind_desc_t* d, void* out);
+
+/*
+ * Parse only what lies on the given dot separated key paths, like "user.name".
+ * Arrays are looked through, so "items.id" keeps the id of every element of
+ * items. Objects on the way keep just the matching members and everything off
+ * the paths is validated and skipped without being decoded or allocated. A
+ * scalar found where a path still goes on is off the path too: object members
+ * and array elements holding one are dropped, and a scalar root gives null.
+ */
+#define JSON_PROJECT_MAX_PATHS 32
+int json_parse_project(json_value_t* v, const char* str, const char* const* paths, size_t npaths);
+
+JSON_TYPE json_type(const json_value_t* v);
 
 double json_get_number(const json_value_t* v);
 
@@ -62,6 +213,15 @@ size_t json_get_string_length(const json_value_t* v);
 
 size_t json_get_array_size(const json_value_t* v);
 json_value_t* json_get_array_element(const json_value_t* v, size_t index);
+/*
+ * Arrays made only of numbers are stored packed. This returns
+ * JSON_FLAG_PACKED_DOUBLE or JSON_FLAG_PACKED_INT and points data at the
+ * double[] or long[] of size elements, or returns 0 for any other array.
+ * json_get_array_element still works on packed arrays, the first call boxes
+ * all elements once. Boxed elements are a cache over data and are read-only,
+ * write through json_doc_set instead.
+ */
+int json_get_number_array(const json_value_t* v, const void** data, size_t* size);
 
 size_t json_get_object_size(const json_value_t* v);
 const char* json_get_object_key(const json_value_t* v, size_t index);
@@ -0,0 +1,264 @@
+/*
+ * Parser template, included by hadrjson.c once per dialect.
+ *
+ * JSON_DIALECT must be defined to a plain number made of JSON_DIALECT_* bits.
+ * Every function gets the number appended to its name and each optional
+ * feature is selected by the preprocessor, so the strict instantiation is the
+ * plain json parser without a single extra branch.
+ */
+#ifndef JSON_DIALECT
+#error "JSON_DIALECT must be defined before including hadrjson_parse.h"
+#endif
+
+#if JSON_DIALECT & JSON_DIALECT_COMMENTS
+#define JSON_SKIP_WHITESPACE(p) (p) = __json_skip_comments(p)
+#else
+#define JSON_SKIP_WHITESPACE(p) while (is_whitespace(*(p))) (p)++
+#endif
+
+static int JSON_D(__json_parse_string)(const char* str, const char** end, json_value_t* v STATS_PARAM) {
+    size_t len;
+    char* s;
+    int ret;
+#ifdef HADRJSON_STATS
+    unsigned long start = stats ? STATS_CYCLES() : 0;
+#endif
+#if JSON_DIALECT & JSON_DIALECT_SINGLE_QUOTES
+    if (*str == '\'')
+        return __json_parse_squote(str, end, v STATS_ARG);
+#endif
+    if ((ret = __json_parse_string_decode(str + 1, end, v->u.i.s, JSON_INLINE_MAX + 1, &s, &len STATS_ARG)) != JSON_PARSE_OK)
+        return ret;
+    if (s == v->u.i.s) {
+        v->u.i.len = (unsigned char)len;
+        v->flags = JSON_FLAG_INLINE;
+    } else {
+        v->u.s.s = s;
+        v->u.s.len = len;
+        v->flags = 0;
+    }
+    STATS(stats->string_cycles += STATS_CYCLES() - start);
+    v->type = JSON_STRING;
+    STATS(stats->nodes[JSON_STRING]++; stats->string_bytes += len);
+    return ret;
+}
+
+static int JSON_D(__json_parse_value)(const char* str, const char** end, json_value_t* v STATS_PARAM DEPTH_PARAM);
+
+static int JSON_D(__json_parse_array)(const char* str, const char** end, json_value_t* v STATS_PARAM DEPTH_PARAM) {
+    json_value_t e, *curr;
+    double* nums = NULL;
+    size_t i, size = 0, capacity = 0;
+    int ret = JSON_PARSE_OK, packed = 1;
+    str++;
+    JSON_SKIP_WHITESPACE(str);
+    if (*str == ']') {
+        *end = str + 1;
+        v->type = JSON_ARRAY;
+        v->u.a.e = NULL;
+        v->u.a.size = 0;
+        STATS(stats->nodes[JSON_ARRAY]++; if (depth + 1 > stats->max_depth) stats->max_depth = depth + 1);
+        return ret;
+    }
+    v->u.a.e = NULL;
+    STATS(if (depth + 1 > stats->max_depth) stats->max_depth = depth + 1);
+    for (;;) {
+        json_init(&e);
+        if ((ret = JSON_D(__json_parse_value)(str, &str, &e STATS_ARG DEPTH_ARG(depth + 1))) != JSON_PARSE_OK) {
+            break;
+        }
+        if (packed && e.type == JSON_NUMBER) {
+            if (size == capacity) {
+                capacity = capacity ? capacity * 2 : 4;
+                nums = (double*)realloc(nums, capacity * sizeof(double));
+                assert(nums);
+                STATS(if (size) stats->reallocs++; else stats->mallocs++);
+            }
+            nums[size++] = e.u.n;
+        } else {
+            if (packed) {
+                v->u.a.e = __json_unpack_numbers(nums, size STATS_ARG);
+                packed = 0;
+            }
+            size++;
+            if (size == 1) {
+                v->u.a.e = (json_value_t*)malloc(sizeof(json_value_t));
+                STATS(stats->mallocs++);
+            } else {
+                v->u.a.e = (json_value_t*)realloc(v->u.a.e, size * sizeof(json_value_t));
+                STATS(stats->reallocs++);
+            }
+            curr = v->u.a.e + size - 1;
+            memcpy(curr, &e, sizeof(json_value_t));
+        }
+        JSON_SKIP_WHITESPACE(str);
+        if (*str == ',') {
+            str++;
+            JSON_SKIP_WHITESPACE(str);
+            if (*str == '\0') {
+                ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                break;
+            }
+#if JSON_DIALECT & JSON_DIALECT_TRAILING_COMMAS
+            if (*str == ']')
+                goto close;
+#endif
+        } else if (*str == ']') {
+#if JSON_DIALECT & JSON_DIALECT_TRAILING_COMMAS
+close:
+#endif
+            *end = str + 1;
+            v->type = JSON_ARRAY;
+            if (packed)
+                __json_pack_numbers(v, nums, size, capacity STATS_ARG);
+            else
+                v->u.a.size = size;
+            STATS(stats->nodes[JSON_ARRAY]++);
+            break;
+        } else {
+            ret =  JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+            break;
+        }
+    }
+    if (ret != JSON_PARSE_OK) {
+        if (packed) {
+            free(nums);
+        } else {
+            for (i = 0; i < size; i++)
+                json_free(&v->u.a.e[i]);
+            free(v->u.a.e);
+        }
+        v->type = JSON_NULL;
+    }
+    return ret;
+}
+
+static int JSON_D(__json_parse_object)(const char* str, const char** end, json_value_t* v STATS_PARAM DEPTH_PARAM) {
+    json_member_t m, *curr;
+    size_t i, size = 0;
+    int ret = JSON_PARSE_OK;
+    str++;
+    JSON_SKIP_WHITESPACE(str);
+    if (*str == '}') {
+        *end = str + 1;
+        v->type = JSON_OBJECT;
+        v->u.o.size = 0;
+        v->u.o.m = NULL;
+        STATS(stats->nodes[JSON_OBJECT]++; if (depth + 1 > stats->max_depth) stats->max_depth = depth + 1);
+        return ret;
+    }
+    STATS(if (depth + 1 > stats->max_depth) stats->max_depth = depth + 1);
+    for (;;) {
+        __json_init_member(&m);
+#if JSON_DIALECT & JSON_DIALECT_SINGLE_QUOTES
+        if (*str == '\'') {
+            if ((ret = __json_parse_squote_key(str, &str, &m STATS_ARG)) != JSON_PARSE_OK)
+                break;
+        } else
+#endif
+        {
+            if (*str != '\"') {
+                ret = JSON_PARSE_MISS_KEY;
+                break;
+            }
+            if ((ret = __json_parse_string_common(str, &str, &m.klen, &m.k STATS_ARG)) != JSON_PARSE_OK)
+                break;
+        }
+        STATS(stats->key_bytes += m.klen);
+        JSON_SKIP_WHITESPACE(str);
+        if (*str != ':') {
+            ret = JSON_PARSE_MISS_COLON;
+            break;
+        }
+        str++;
+        JSON_SKIP_WHITESPACE(str);
+        if ((ret = JSON_D(__json_parse_value)(str, &str, &m.v STATS_ARG DEPTH_ARG(depth + 1))) != JSON_PARSE_OK)
+            break;
+        size++;
+        if (size == 1) {
+            v->u.o.m = (json_member_t*)malloc(sizeof(json_member_t));
+            STATS(stats->mallocs++);
+        } else {
+            v->u.o.m = (json_member_t*)realloc(v->u.o.m, size * sizeof(json_member_t));
+            STATS(stats->reallocs++);
+        }
+        curr = v->u.o.m + size - 1;
+        memcpy(curr, &m, sizeof(json_member_t));
+        m.k = NULL;
+        JSON_SKIP_WHITESPACE(str);
+        if (*str == ',') {
+            str++;
+            JSON_SKIP_WHITESPACE(str);
+#if JSON_DIALECT & JSON_DIALECT_TRAILING_COMMAS
+            if (*str == '}')
+                goto close;
+#endif
+        } else if (*str == '}') {
+#if JSON_DIALECT & JSON_DIALECT_TRAILING_COMMAS
+close:
+#endif
+            *end = str + 1;
+            v->type = JSON_OBJECT;
+            v->u.o.size = size;
+            STATS(stats->nodes[JSON_OBJECT]++);
+            break;
+        } else {
+            ret = JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+            break;
+        }
+    }
+    if (ret != JSON_PARSE_OK) {
+        for (i = 0; i < size; i++) {
+            free(v->u.o.m[i].k);
+            json_free(&v->u.o.m[i].v);
+        }
+        if (size)
+            free(v->u.o.m);
+        free(m.k);
+        v->type = JSON_NULL;
+    }
+    return ret;
+}
+
+static int JSON_D(__json_parse_value)(const char* str, const char** end, json_value_t* v STATS_PARAM DEPTH_PARAM) {
+    switch (*str) {
+        case 'n':  return __json_parse_literal(str, end, "null", JSON_NULL, v STATS_ARG);
+        case 't':  return __json_parse_literal(str, end, "true", JSON_TRUE, v STATS_ARG);
+        case 'f':  return __json_parse_literal(str, end, "false", JSON_FALSE, v STATS_ARG);
+        case '"':  return JSON_D(__json_parse_string)(str, end, v STATS_ARG);
+        case '[':  return JSON_D(__json_parse_array)(str, end, v STATS_ARG DEPTH_ARG(depth));
+        case '{':  return JSON_D(__json_parse_object)(str, end, v STATS_ARG DEPTH_ARG(depth));
+#if JSON_DIALECT & JSON_DIALECT_SINGLE_QUOTES
+        case '\'': return JSON_D(__json_parse_string)(str, end, v STATS_ARG);
+#endif
+#if JSON_DIALECT & JSON_DIALECT_NONFINITE
+        case 'N':
+        case 'I':  return __json_parse_nonfinite(str, end, v STATS_ARG);
+        case '-':
+            if (str[1] == 'I')
+                return __json_parse_nonfinite(str, end, v STATS_ARG);
+            return __json_parse_number(str, end, v STATS_ARG);
+#endif
+        default:   return __json_parse_number(str, end, v STATS_ARG);
+        case '\0': return JSON_PARSE_EXPECT_VALUE;
+    }
+}
+
+static int JSON_D(__json_parse)(json_value_t* v, const char** str STATS_PARAM) {
+    int ret;
+    const char* p = *str;
+    assert(v != NULL);
+    json_init(v);
+    JSON_SKIP_WHITESPACE(p);
+    if ((ret = JSON_D(__json_parse_value)(p, &p, v STATS_ARG DEPTH_ARG(0))) == JSON_PARSE_OK) {
+        JSON_SKIP_WHITESPACE(p);
+        if (*p != '\0') {
+            json_free(v);
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        }
+    }
+    *str = p;
+    return ret;
+}
+
+#undef JSON_SKIP_WHITESPACE
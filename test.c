@@ -3,6 +3,15 @@
 #include <string.h>
 #include "hadrjson.h"
 
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HEAP_IN_USE() (mallinfo2().uordblks)
+#endif
+
+#ifndef HADRJSON_NO_THREADS
+#include <pthread.h>
+#endif
+
 static int main_ret = 0;
 static int test_count = 0;
 static int test_pass = 0;
@@ -62,6 +71,55 @@ static void test_parse_string() {
     TEST_STRING("\xE2\x82\xAC", "\"\\u20AC\""); /* Euro sign U+20AC */
     TEST_STRING("\xF0\x9D\x84\x9E", "\"\\uD834\\uDD1E\"");  /* G clef sign U+1D11E */
     TEST_STRING("\xF0\x9D\x84\x9E", "\"\\ud834\\udd1e\"");  /* G clef sign U+1D11E */
+    TEST_STRING("0123456789", "\"0123456789\"");               /* stored inline */
+    TEST_STRING("0123456789012345678901234567890123456789", "\"0123456789012345678901234567890123456789\"");
+}
+
+static void test_parse_string_inline() {
+    char json[JSON_INLINE_MAX + 4];
+    size_t i, len;
+    json_value_t v;
+    for (len = JSON_INLINE_MAX; len <= JSON_INLINE_MAX + 1; len++) {
+        json[0] = '\"';
+        for (i = 0; i < len; i++)
+            json[i + 1] = (char)('a' + i % 26);
+        json[len + 1] = '\"';
+        json[len + 2] = '\0';
+        json_init(&v);
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));
+        EXPECT_EQ_SIZE_T(len, json_get_string_length(&v));
+        EXPECT_EQ_INT(0, memcmp(json + 1, json_get_string(&v), len));
+        EXPECT_EQ_INT('\0', json_get_string(&v)[len]);
+        json_free(&v);
+    }
+}
+
+/* long strings are decoded in one pass, the buffer grows while escapes are expanded */
+static void test_parse_string_long() {
+    static const char piece[] = "ab\\n\\u00e9\\uD834\\uDD1E";
+    static const char decoded[] = "ab\n\xC3\xA9\xF0\x9D\x84\x9E";
+    char json[2 + 300 * (sizeof(piece) - 1) + 1];
+    size_t i, n, count;
+    json_value_t v;
+    for (count = 1; count <= 300; count *= 3) {
+        json[0] = '\"';
+        for (i = 0; i < count; i++)
+            memcpy(json + 1 + i * (sizeof(piece) - 1), piece, sizeof(piece) - 1);
+        n = 1 + count * (sizeof(piece) - 1);
+        json[n] = '\"';
+        json[n + 1] = '\0';
+        json_init(&v);
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));
+        EXPECT_EQ_SIZE_T((count * (sizeof(decoded) - 1)), json_get_string_length(&v));
+        for (i = 0; i < count && !memcmp(json_get_string(&v) + i * (sizeof(decoded) - 1), decoded, sizeof(decoded) - 1); i++);
+        EXPECT_EQ_SIZE_T(count, i);
+        EXPECT_EQ_INT('\0', json_get_string(&v)[json_get_string_length(&v)]);
+        json_free(&v);
+        /* an error late in a long string releases what was decoded so far */
+        json[n] = '\0';
+        json_init(&v);
+        EXPECT_EQ_INT(JSON_PARSE_MISS_QUOTATION_MARK, json_parse(&v, json));
+    }
 }
 
 #define TEST_NUMBER(expect, json)\
@@ -128,6 +186,11 @@ static void test_parse_array() {
     EXPECT_EQ_STRING("abc", json_get_string(json_get_array_element(&v, 4)), json_get_string_length(json_get_array_element(&v, 4)));
     json_free(&v);
 
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[1.5]"));
+    EXPECT_EQ_DOUBLE(1.5, json_get_number(json_get_array_element(&v, 0)));
+    json_free(&v);
+
     json_init(&v);
     EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[ [ ] , [ 0 ] , [ 0 , 1 ] , [ 0 , 1 , 2 ] ]"));
     EXPECT_EQ_INT(JSON_ARRAY, json_type(&v));
@@ -235,6 +298,8 @@ static void test_parse_invalid_value() {
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "+1");
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, ".123"); /* at least one digit before '.' */
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "1.");   /* at least one digit after '.' */
+    TEST_ERROR(JSON_PARSE_INVALID_VALUE, "1e");   /* at least one digit in the exponent */
+    TEST_ERROR(JSON_PARSE_INVALID_VALUE, "[1E+]");
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "INF");
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "inf");
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "NAN");
@@ -242,6 +307,7 @@ static void test_parse_invalid_value() {
 
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "[1,]");
     TEST_ERROR(JSON_PARSE_INVALID_VALUE, "[\"a\", nul]");
+    TEST_ERROR(JSON_PARSE_INVALID_VALUE, "[?]");
 }
 
 static void test_parse_root_not_singular() {
@@ -297,6 +363,28 @@ static void test_parse_invalid_unicode_surrogate() {
     TEST_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE, "\"\\uD800\\uE000\"");
 }
 
+static void test_parse_invalid_utf8() {
+#ifndef HADRJSON_NO_UTF8_VALIDATION
+    TEST_STRING("\xE2\x82\xAC", "\"\xE2\x82\xAC\"");
+    TEST_STRING("0123456789abcdef\xF0\x9D\x84\x9E" "0123456789abcdef", "\"0123456789abcdef\xF0\x9D\x84\x9E" "0123456789abcdef\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"\x80\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"\xC0\x80\"");           /* overlong */
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"\xE0\x80\x80\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"\xED\xA0\x80\"");       /* surrogate */
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"\xF4\x90\x80\x80\"");   /* above U+10FFFF */
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"\xE2\x82\"");           /* truncated */
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"0123456789abcdef\xE2\x82\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"0123456789abcde\xF0\x9D\x84\x9E\xFF" "0123456789abcdef\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "{\"\xC3\":1}");
+    /* sequences across the hand-over to the vector scan */
+    TEST_STRING("0123456789abcd\xE2\x82\xAC" "0123456789abcdef", "\"0123456789abcd\xE2\x82\xAC" "0123456789abcdef\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"0123456789abcd\xE2\x82\x41" "0123456789abcdef\"");
+    TEST_ERROR(JSON_PARSE_INVALID_UTF8, "\"0123456789abcdef\\n0123456789abcdef\xC3\"");
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_validate_utf8("\xC3\xA9", 2));
+    EXPECT_EQ_INT(JSON_PARSE_INVALID_UTF8, json_validate_utf8("\xC3\xA9", 1));
+#endif
+}
+
 static void test_parse_miss_comma_or_square_bracket() {
     TEST_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[1");
     TEST_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[1 2]");
@@ -331,6 +419,8 @@ void test_parse() {
     test_parse_literal();
     test_parse_number();
     test_parse_string();
+    test_parse_string_inline();
+    test_parse_string_long();
     test_parse_array();
 #if 1
     test_parse_object();
@@ -345,6 +435,7 @@ void test_parse() {
     test_parse_invalid_unicode_hex();
     test_parse_invalid_unicode_surrogate();
     test_parse_miss_comma_or_square_bracket();
+    test_parse_invalid_utf8();
 #if 1
     test_parse_miss_key();
     test_parse_miss_colon();
@@ -352,8 +443,730 @@ void test_parse() {
 #endif
 }
 
+#define TEST_MINIFY(expect, json)\
+    do {\
+        char out[sizeof(json)];\
+        size_t len;\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_minify(json, sizeof(json) - 1, out, sizeof(out), &len));\
+        EXPECT_EQ_STRING(expect, out, len);\
+    } while(0)
+
+#define TEST_PRETTIFY(expect, json, indent)\
+    do {\
+        char out[sizeof(expect)];\
+        size_t len;\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_prettify(json, sizeof(json) - 1, NULL, 0, &len, indent));\
+        EXPECT_EQ_SIZE_T(sizeof(expect) - 1, len);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_prettify(json, sizeof(json) - 1, out, sizeof(out), &len, indent));\
+        EXPECT_EQ_STRING(expect, out, len);\
+    } while(0)
+
+#define TEST_FORMAT_ERROR(error, json)\
+    do {\
+        char out[sizeof(json)];\
+        EXPECT_EQ_INT(error, json_minify(json, sizeof(json) - 1, out, sizeof(out), NULL));\
+    } while(0)
+
+static void test_format() {
+    TEST_MINIFY("null", " null ");
+    TEST_MINIFY("-1.5e+10", "-1.5e+10");
+    TEST_MINIFY("\" a \\n \\uD834\\uDD1E \"", " \" a \\n \\uD834\\uDD1E \" ");
+    TEST_MINIFY("[]", "[ ]");
+    TEST_MINIFY("{}", "{ }");
+    TEST_MINIFY("[1,[true,false],{\"a\":null}]", " [ 1 , [ true , false ] , { \"a\" : null } ] ");
+
+    TEST_PRETTIFY("[]", " [ ] ", 2);
+    TEST_PRETTIFY("[\n  1,\n  2\n]", "[1,2]", 2);
+    TEST_PRETTIFY("{\n    \"a\": [\n        true\n    ],\n    \"b\": {}\n}", "{\"a\":[true],\"b\":{}}", 4);
+
+    /* out is never written past size, the result is still measured */
+    {
+        char out[8];
+        size_t len;
+        memset(out, 'x', sizeof(out));
+        EXPECT_EQ_INT(JSON_PARSE_BUFFER_TOO_SMALL, json_prettify("[1,2]", 5, out, 6, &len, 2));
+        EXPECT_EQ_SIZE_T(12, len);
+        EXPECT_EQ_STRING("[\n  1", out, 5);
+        EXPECT_EQ_INT('x', out[6]);
+        EXPECT_EQ_INT(JSON_PARSE_BUFFER_TOO_SMALL, json_minify("[ 1 ]", 5, out, 3, &len));
+        EXPECT_EQ_SIZE_T(3, len);
+        EXPECT_EQ_STRING("[1", out, 2);
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_minify("[ 1 ]", 5, out, 4, &len));
+        EXPECT_EQ_STRING("[1]", out, 3);
+        EXPECT_EQ_INT(JSON_PARSE_INVALID_VALUE, json_minify("[ 1, ]", 6, out, 2, &len));
+        EXPECT_EQ_INT('\0', out[1]);
+    }
+
+    /* length bounds the input, not the terminator */
+    {
+        char out[8];
+        size_t len;
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_minify("[ 1 ] garbage", 5, out, sizeof(out), &len));
+        EXPECT_EQ_STRING("[1]", out, len);
+        EXPECT_EQ_INT(JSON_PARSE_MISS_QUOTATION_MARK, json_minify("\"0123456789abcdef0123456789abcdef\"", 33, NULL, 0, &len));
+    }
+
+    /* nesting does not use the C stack */
+    {
+        size_t i, len, depth = 100001;
+        char* json = (char*)malloc(depth * 6 + 1);
+        char* out = (char*)malloc(depth * 6 + 1);
+        for (i = 0; i < depth; i++)
+            memcpy(json + i * 5, i % 2 ? "{\"a\":" : "[    ", 5);
+        for (i = depth; i-- > 0; )
+            json[depth * 6 - 1 - i] = i % 2 ? '}' : ']';
+        json[depth * 6] = '\0';
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_minify(json, depth * 6, out, depth * 6 + 1, &len));
+        EXPECT_EQ_SIZE_T(((depth - depth / 2) * 2 + depth / 2 * 6), len);
+        EXPECT_EQ_INT(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, json_minify(json, depth * 6 - 2, NULL, 0, &len));
+        free(json);
+        free(out);
+    }
+
+    TEST_FORMAT_ERROR(JSON_PARSE_EXPECT_VALUE, " ");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_VALUE, "nul");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_VALUE, "[1,]");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_VALUE, "1e");
+    TEST_FORMAT_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "1e309");
+    TEST_FORMAT_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "0.00017976931348623159e312");
+    /* overflow comes from the magnitude, however long the number is */
+    {
+        char json[512];
+        size_t len;
+        memset(json, '9', 401);
+        json[401] = '\0';
+        TEST_FORMAT_ERROR(JSON_PARSE_NUMBER_TOO_BIG, json);
+        strcpy(json + 401, "e-100");
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_minify(json, strlen(json), NULL, 0, &len));
+        EXPECT_EQ_SIZE_T(406, len);
+    }
+    TEST_FORMAT_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "null n");
+    TEST_FORMAT_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "0123");
+    TEST_FORMAT_ERROR(JSON_PARSE_MISS_QUOTATION_MARK, "\"Hello");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_STRING_ESCAPE, "\"\\v\"");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_STRING_CHAR, "\"\x01\"");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_UNICODE_HEX, "\"\\u0G00\"");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE, "\"\\uD800\"");
+    TEST_FORMAT_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[1 2]");
+    TEST_FORMAT_ERROR(JSON_PARSE_MISS_KEY, "{1:1}");
+    TEST_FORMAT_ERROR(JSON_PARSE_MISS_COLON, "{\"a\"}");
+    TEST_FORMAT_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"a\":1");
+#ifndef HADRJSON_NO_UTF8_VALIDATION
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_UTF8, "[\"\xED\xA0\x80\"]");
+    TEST_FORMAT_ERROR(JSON_PARSE_INVALID_UTF8, "[\"a string long enough for vectors \xC3\x28\"]");
+#endif
+}
+
+typedef struct {
+    double x, y;
+} point_t;
+
+typedef struct {
+    long id;
+    int ok;
+    char* name;
+    point_t at;
+} record_t;
+
+static const json_bind_field_t point_fields[] = {
+    JSON_BIND_FIELD("x", JSON_BIND_DOUBLE, point_t, x, NULL),
+    JSON_BIND_FIELD("y", JSON_BIND_DOUBLE, point_t, y, NULL)
+};
+static json_bind_desc_t point_desc = JSON_BIND_DESC(point_fields);
+
+static const json_bind_field_t record_fields[] = {
+    JSON_BIND_FIELD("id", JSON_BIND_INT, record_t, id, NULL),
+    JSON_BIND_FIELD("ok", JSON_BIND_BOOL, record_t, ok, NULL),
+    JSON_BIND_FIELD("name", JSON_BIND_STRING, record_t, name, NULL),
+    JSON_BIND_FIELD("at", JSON_BIND_OBJECT, record_t, at, &point_desc)
+};
+static json_bind_desc_t record_desc = JSON_BIND_DESC(record_fields);
+
+#define TEST_BIND_ERROR(error, json)\
+    do {\
+        record_t r;\
+        memset(&r, 0, sizeof(r));\
+        EXPECT_EQ_INT(error, json_bind_parse(&record_desc, &r, json));\
+        json_bind_free(&record_desc, &r);\
+    } while(0)
+
+static void test_bind() {
+    record_t r;
+    EXPECT_EQ_INT(0, json_bind_compile(&record_desc));
+
+    memset(&r, 0, sizeof(r));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_bind_parse(&record_desc, &r,
+        " { "
+        "\"skip\" : [ { \"id\" : 7 }, \"x\\u0041\", 1e3, null ], "
+        "\"id\" : 42 , "
+        "\"ok\" : true , "
+        "\"n\\u0061me\" : \"Hello\\nWorld\" , "
+        "\"at\" : { \"y\" : -1.5, \"z\" : {}, \"x\" : 0.25 } "
+        " } "
+    ));
+    EXPECT_EQ_INT(42, (int)r.id);
+    EXPECT_EQ_INT(1, r.ok);
+    EXPECT_EQ_STRING("Hello\nWorld", r.name, strlen(r.name));
+    EXPECT_EQ_DOUBLE(0.25, r.at.x);
+    EXPECT_EQ_DOUBLE(-1.5, r.at.y);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_bind_parse(&record_desc, &r, "{\"name\":\"abc\",\"ok\":null}"));
+    EXPECT_EQ_STRING("abc", r.name, strlen(r.name));
+    EXPECT_EQ_INT(1, r.ok);
+    json_bind_free(&record_desc, &r);
+    EXPECT_EQ_INT(1, (r.name == NULL));
+
+    TEST_BIND_ERROR(JSON_PARSE_EXPECT_VALUE, " ");
+    TEST_BIND_ERROR(JSON_PARSE_BIND_TYPE_MISMATCH, "[]");
+    TEST_BIND_ERROR(JSON_PARSE_BIND_TYPE_MISMATCH, "{\"id\":\"42\"}");
+    TEST_BIND_ERROR(JSON_PARSE_BIND_TYPE_MISMATCH, "{\"id\":1.5}");
+    TEST_BIND_ERROR(JSON_PARSE_BIND_TYPE_MISMATCH, "{\"at\":[]}");
+    TEST_BIND_ERROR(JSON_PARSE_INVALID_VALUE, "{\"skip\":[1,]}");
+    TEST_BIND_ERROR(JSON_PARSE_INVALID_VALUE, "{\"skip\":1e}");
+    TEST_BIND_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "{\"skip\":[1e999],\"id\":1}");
+    TEST_BIND_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE, "{\"skip\":\"\\uD800\"}");
+#ifndef HADRJSON_NO_UTF8_VALIDATION
+    TEST_BIND_ERROR(JSON_PARSE_INVALID_UTF8, "{\"0123456789abcd\xE2\x82\":1}");
+    TEST_BIND_ERROR(JSON_PARSE_INVALID_UTF8, "{\"a key long enough for vectors \xC3\x28\":1}");
+#endif
+    TEST_BIND_ERROR(JSON_PARSE_INVALID_STRING_ESCAPE, "{\"skip\":\"\\v\"}");
+    TEST_BIND_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"skip\":[1 2]}");
+    TEST_BIND_ERROR(JSON_PARSE_MISS_COLON, "{\"name\",\"x\"}");
+    TEST_BIND_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"name\":\"x\"");
+    TEST_BIND_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "{} x");
+}
+
+static void test_bind_large() {
+    static const size_t sizes[] = { 24, 48, JSON_BIND_SLOTS - 1 };
+    json_bind_field_t fields[JSON_BIND_SLOTS];
+    json_bind_desc_t d;
+    char keys[JSON_BIND_SLOTS][16];
+    char json[JSON_BIND_SLOTS * 24 + 32];
+    long out[JSON_BIND_SLOTS];
+    size_t i, n, len;
+    for (i = 0; i < JSON_BIND_SLOTS; i++) {
+        sprintf(keys[i], "field_%lu", (unsigned long)(i * 7919 % 1000));
+        fields[i].key = keys[i];
+        fields[i].type = JSON_BIND_INT;
+        fields[i].offset = i * sizeof(long);
+        fields[i].nested = NULL;
+    }
+    for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        memset(&d, 0, sizeof(d));
+        d.fields = fields;
+        d.size = sizes[n];
+        EXPECT_EQ_INT(0, json_bind_compile(&d));
+        len = sprintf(json, "{\"unknown\":0");
+        for (i = 0; i < d.size; i++)
+            len += sprintf(json + len, ",\"%s\":%lu", keys[i], (unsigned long)i);
+        strcpy(json + len, "}");
+        memset(out, 0, sizeof(out));
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_bind_parse(&d, out, json));
+        for (i = 0; i < d.size && out[i] == (long)i; i++);
+        EXPECT_EQ_SIZE_T(d.size, i);
+    }
+    d.size = JSON_BIND_SLOTS;
+    EXPECT_EQ_INT(-1, json_bind_compile(&d));
+    /* an object field needs a descriptor for its members */
+    fields[0].type = JSON_BIND_OBJECT;
+    d.size = 1;
+    EXPECT_EQ_INT(-1, json_bind_compile(&d));
+}
+
+#define TEST_DIALECT_ERROR(error, json, dialect)\
+    do {\
+        json_value_t v;\
+        json_init(&v);\
+        v.type = JSON_FALSE;\
+        EXPECT_EQ_INT(error, json_parse_dialect(&v, json, dialect));\
+        EXPECT_EQ_INT(JSON_NULL, json_type(&v));\
+        json_free(&v);\
+    } while(0)
+
+static void test_parse_dialect() {
+    json_value_t v, *e;
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_dialect(&v, "/* head */ [ 1, // one\n 2 /**/ ] // tail", JSON_DIALECT_COMMENTS));
+    EXPECT_EQ_SIZE_T(2, json_get_array_size(&v));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_dialect(&v, "{ \"a\" : [ 1, 2, ], }", JSON_DIALECT_TRAILING_COMMAS));
+    EXPECT_EQ_SIZE_T(1, json_get_object_size(&v));
+    EXPECT_EQ_SIZE_T(2, json_get_array_size(json_get_object_value(&v, 0)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_dialect(&v, "[ NaN, Infinity, -Infinity, -1 ]", JSON_DIALECT_NONFINITE));
+    e = json_get_array_element(&v, 0);
+    EXPECT_EQ_INT(1, (json_get_number(e) != json_get_number(e)));
+    EXPECT_EQ_INT(1, (json_get_number(json_get_array_element(&v, 1)) > 1.7976931348623157e+308));
+    EXPECT_EQ_INT(1, (json_get_number(json_get_array_element(&v, 2)) < -1.7976931348623157e+308));
+    EXPECT_EQ_DOUBLE(-1.0, json_get_number(json_get_array_element(&v, 3)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_dialect(&v, "{ 'k\\'ey' : 'say \"hi\"', \"b\" : 'a very long single quoted string value' }", JSON_DIALECT_SINGLE_QUOTES));
+    EXPECT_EQ_STRING("k'ey", json_get_object_key(&v, 0), json_get_object_key_length(&v, 0));
+    EXPECT_EQ_STRING("say \"hi\"", json_get_string(json_get_object_value(&v, 0)), json_get_string_length(json_get_object_value(&v, 0)));
+    EXPECT_EQ_STRING("a very long single quoted string value", json_get_string(json_get_object_value(&v, 1)), json_get_string_length(json_get_object_value(&v, 1)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_dialect(&v, "// all\n{ 'a' : [ NaN, ], /* x */ }", JSON_DIALECT_ALL));
+    EXPECT_EQ_SIZE_T(1, json_get_array_size(json_get_object_value(&v, 0)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_dialect(&v, "[ \"strict\" ]", 0));
+    json_free(&v);
+
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_VALUE, "[ 1, ]", 0);
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_VALUE, "/**/ 1", JSON_DIALECT_TRAILING_COMMAS);
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_VALUE, "NaN", JSON_DIALECT_COMMENTS);
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_VALUE, "'a'", JSON_DIALECT_NONFINITE);
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_VALUE, "[ 1, , ]", JSON_DIALECT_TRAILING_COMMAS);
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_VALUE, "-NaN", JSON_DIALECT_NONFINITE);
+    TEST_DIALECT_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[ 1 /* ]", JSON_DIALECT_COMMENTS);
+    TEST_DIALECT_ERROR(JSON_PARSE_MISS_QUOTATION_MARK, "'abc", JSON_DIALECT_SINGLE_QUOTES);
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_STRING_ESCAPE, "'\\v'", JSON_DIALECT_SINGLE_QUOTES);
+    TEST_DIALECT_ERROR(JSON_PARSE_MISS_KEY, "{ 'a' : 1, }", JSON_DIALECT_SINGLE_QUOTES);
+#ifndef HADRJSON_NO_UTF8_VALIDATION
+    TEST_DIALECT_ERROR(JSON_PARSE_INVALID_UTF8, "'caf\xC3'", JSON_DIALECT_SINGLE_QUOTES);
+#endif
+    TEST_DIALECT_ERROR(JSON_PARSE_UNKNOWN_DIALECT, "[]", 0x10);
+    TEST_DIALECT_ERROR(JSON_PARSE_UNKNOWN_DIALECT, "[]", -1);
+}
+
+static void test_parse_stats() {
+#ifdef HADRJSON_STATS
+    json_value_t v;
+    json_parse_stats_t stats;
+    const char* json = " { \"a\" : [ 1, \"x\\ny\", [ true, null ] ], \"bc\" : {} } ";
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_stats(&v, json, &stats));
+    EXPECT_EQ_SIZE_T(strlen(json), stats.bytes);
+    EXPECT_EQ_SIZE_T(2, stats.nodes[JSON_OBJECT]);
+    EXPECT_EQ_SIZE_T(2, stats.nodes[JSON_ARRAY]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[JSON_NUMBER]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[JSON_STRING]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[JSON_TRUE]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[JSON_NULL]);
+    EXPECT_EQ_SIZE_T(3, stats.max_depth);
+    EXPECT_EQ_SIZE_T(3, stats.string_bytes);
+    EXPECT_EQ_SIZE_T(3, stats.key_bytes);
+    EXPECT_EQ_SIZE_T(1, stats.escapes);
+    EXPECT_EQ_SIZE_T(5, stats.mallocs);  /* the short string is stored inline */
+    EXPECT_EQ_SIZE_T(5, stats.reallocs);  /* "a" starts packed and is unpacked at the string */
+    json_free(&v);
+#endif
+}
+
+#define TEST_PROJECT_ERROR(error, json)\
+    do {\
+        json_value_t v;\
+        json_init(&v);\
+        v.type = JSON_FALSE;\
+        EXPECT_EQ_INT(error, json_parse_project(&v, json, paths, 2));\
+        EXPECT_EQ_INT(JSON_NULL, json_type(&v));\
+        json_free(&v);\
+    } while(0)
+
+static void test_parse_project() {
+    static const char* const paths[] = { "user.name", "items.id", "all" };
+    json_value_t v, *e;
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_project(&v,
+        " { "
+        "\"skip\" : [ { \"id\" : 7 }, \"a rather long string with \\\"quotes\\\" and \\u00e9 in it\", 1e3 ], "
+        "\"user\" : { \"age\" : 30, \"n\\u0061me\" : \"Ann\", \"tags\" : [ \"x\" ] }, "
+        "\"items\" : [ { \"id\" : 1, \"v\" : \"\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\" }, { \"v\" : null }, 5 ], "
+        "\"all\" : { \"a\" : [ 1, 2 ] } "
+        " } ", paths, 3));
+    EXPECT_EQ_SIZE_T(3, json_get_object_size(&v));
+    EXPECT_EQ_STRING("user", json_get_object_key(&v, 0), json_get_object_key_length(&v, 0));
+    e = json_get_object_value(&v, 0);
+    EXPECT_EQ_SIZE_T(1, json_get_object_size(e));
+    EXPECT_EQ_STRING("name", json_get_object_key(e, 0), json_get_object_key_length(e, 0));
+    EXPECT_EQ_STRING("Ann", json_get_string(json_get_object_value(e, 0)), json_get_string_length(json_get_object_value(e, 0)));
+    e = json_get_object_value(&v, 1);
+    /* the element 5 is off the path and dropped */
+    EXPECT_EQ_SIZE_T(2, json_get_array_size(e));
+    EXPECT_EQ_SIZE_T(1, json_get_object_size(json_get_array_element(e, 0)));
+    EXPECT_EQ_DOUBLE(1.0, json_get_number(json_get_object_value(json_get_array_element(e, 0), 0)));
+    EXPECT_EQ_SIZE_T(0, json_get_object_size(json_get_array_element(e, 1)));
+    e = json_get_object_value(&v, 2);
+    EXPECT_EQ_SIZE_T(2, json_get_array_size(json_get_object_value(e, 0)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_project(&v, "[ { \"user\" : 1 } ]", paths, 0));
+    EXPECT_EQ_SIZE_T(0, json_get_object_size(json_get_array_element(&v, 0)));
+    json_free(&v);
+
+    /* a scalar where the path goes on is not materialized */
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_project(&v, "{ \"user\" : \"a string too long to be inline\", \"items\" : [ 1, [ 2 ] ] }", paths, 2));
+    EXPECT_EQ_SIZE_T(1, json_get_object_size(&v));
+    EXPECT_EQ_STRING("items", json_get_object_key(&v, 0), json_get_object_key_length(&v, 0));
+    e = json_get_object_value(&v, 0);
+    EXPECT_EQ_SIZE_T(1, json_get_array_size(e));
+    EXPECT_EQ_SIZE_T(0, json_get_array_size(json_get_array_element(e, 0)));
+    json_free(&v);
+
+    json_init(&v);
+    v.type = JSON_FALSE;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_project(&v, " 42 ", paths, 2));
+    EXPECT_EQ_INT(JSON_NULL, json_type(&v));
+
+    TEST_PROJECT_ERROR(JSON_PARSE_EXPECT_VALUE, " ");
+    TEST_PROJECT_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "{\"x\":1e999,\"user\":{}}");
+    TEST_PROJECT_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "{\"user\":{\"age\":-1e999}}");
+    TEST_PROJECT_ERROR(JSON_PARSE_INVALID_VALUE, "{\"skip\":[1,]}");
+    TEST_PROJECT_ERROR(JSON_PARSE_INVALID_STRING_CHAR, "{\"skip\":\"a string long enough for vectors\x01\"}");
+    TEST_PROJECT_ERROR(JSON_PARSE_MISS_QUOTATION_MARK, "{\"skip\":\"a string long enough for vectors");
+    TEST_PROJECT_ERROR(JSON_PARSE_INVALID_STRING_ESCAPE, "{\"skip\":\"a string long enough for vectors\\v\"}");
+    TEST_PROJECT_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"user\":{\"name\":1}");
+    TEST_PROJECT_ERROR(JSON_PARSE_MISS_COLON, "{\"items\":[{\"id\" 1}]}");
+    TEST_PROJECT_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "{} x");
+#ifndef HADRJSON_NO_UTF8_VALIDATION
+    TEST_PROJECT_ERROR(JSON_PARSE_INVALID_UTF8, "{\"skip\":\"a string long enough for vectors \xC3\x28\"}");
+#endif
+}
+
+#ifndef HADRJSON_NO_THREADS
+/* every thread races to box the packed arrays of a fresh document */
+static void* test_packed_worker(void* arg) {
+    const json_value_t* root = json_doc_root((json_doc_t*)arg);
+    const json_value_t* a;
+    size_t i, j;
+    for (i = 0; i < json_get_array_size(root); i++) {
+        a = json_get_array_element(root, i);
+        for (j = 0; j < json_get_array_size(a); j++) {
+            if (json_get_number(json_get_array_element(a, j)) != (double)(i + j))
+                return arg;
+        }
+    }
+    return NULL;
+}
+#endif
+
+static void test_parse_packed() {
+    static const char* const path[] = { "a", "1" };
+    json_value_t v, *e;
+    json_doc_t *doc, *next;
+    const void* data;
+    size_t size;
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[ 1, -2, 3e2, 4, 5 ]"));
+    EXPECT_EQ_INT(JSON_FLAG_PACKED_INT, json_get_number_array(&v, &data, &size));
+    EXPECT_EQ_SIZE_T(5, size);
+    EXPECT_EQ_INT(-2, (int)((const long*)data)[1]);
+    EXPECT_EQ_INT(300, (int)((const long*)data)[2]);
+    EXPECT_EQ_SIZE_T(5, json_get_array_size(&v));
+    e = json_get_array_element(&v, 4);
+    EXPECT_EQ_INT(JSON_NUMBER, json_type(e));
+    EXPECT_EQ_DOUBLE(5.0, json_get_number(e));
+    EXPECT_EQ_INT(1, (e == json_get_array_element(&v, 4)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[ 0.5, 1, -0 ]"));
+    EXPECT_EQ_INT(JSON_FLAG_PACKED_DOUBLE, json_get_number_array(&v, &data, &size));
+    EXPECT_EQ_SIZE_T(3, size);
+    EXPECT_EQ_DOUBLE(0.5, ((const double*)data)[0]);
+    EXPECT_EQ_DOUBLE(1.0, json_get_number(json_get_array_element(&v, 1)));
+    json_free(&v);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[ 1, 2, 3, 4, 5, \"x\", 7 ]"));
+    EXPECT_EQ_INT(0, json_get_number_array(&v, &data, &size));
+    EXPECT_EQ_SIZE_T(7, json_get_array_size(&v));
+    EXPECT_EQ_DOUBLE(5.0, json_get_number(json_get_array_element(&v, 4)));
+    EXPECT_EQ_INT(JSON_STRING, json_type(json_get_array_element(&v, 5)));
+    EXPECT_EQ_DOUBLE(7.0, json_get_number(json_get_array_element(&v, 6)));
+    json_free(&v);
+    EXPECT_EQ_INT(0, v.flags);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[]"));
+    EXPECT_EQ_INT(0, json_get_number_array(&v, &data, &size));
+    json_free(&v);
+
+    TEST_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[ 1, 2, 3, 4, 5 }");
+    TEST_ERROR(JSON_PARSE_INVALID_VALUE, "[ 1, 2, 3, 4, 5, ? ]");
+
+    /* editing inside a packed array unpacks the copy only */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_doc_parse(&doc, "{ \"a\" : [ 1, 2, 3 ], \"b\" : [ 0.5 ] }"));
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "true"));
+    EXPECT_EQ_INT(0, json_doc_set(&next, doc, path, 2, &v));
+    EXPECT_EQ_INT(JSON_FLAG_PACKED_INT, json_get_number_array(json_get_object_value(json_doc_root(doc), 0), &data, &size));
+    EXPECT_EQ_INT(0, json_get_number_array(json_get_object_value(json_doc_root(next), 0), &data, &size));
+    EXPECT_EQ_INT(JSON_TRUE, json_type(json_get_array_element(json_get_object_value(json_doc_root(next), 0), 1)));
+    EXPECT_EQ_DOUBLE(3.0, json_get_number(json_get_array_element(json_get_object_value(json_doc_root(next), 0), 2)));
+    EXPECT_EQ_DOUBLE(0.5, json_get_number(json_get_array_element(json_get_object_value(json_doc_root(next), 1), 0)));
+    json_doc_release(doc);
+    json_doc_release(next);
+#ifndef HADRJSON_NO_THREADS
+    {
+        pthread_t threads[8];
+        void* ret[8];
+        char json[64 * 32];
+        size_t len;
+        int round, i, j, ok = 1;
+        len = 0;
+        json[len++] = '[';
+        for (i = 0; i < 64; i++)
+            len += sprintf(json + len, "%s[%d,%d,%d,%d]", i ? "," : "", i, i + 1, i + 2, i + 3);
+        json[len++] = ']';
+        json[len] = '\0';
+        for (round = 0; round < 20; round++) {
+            EXPECT_EQ_INT(JSON_PARSE_OK, json_doc_parse(&doc, json));
+            for (i = 0; i < 8; i++)
+                pthread_create(&threads[i], NULL, test_packed_worker, doc);
+            for (i = 0; i < 8; i++)
+                pthread_join(threads[i], &ret[i]);
+            for (j = 0; j < 8; j++)
+                ok &= ret[j] == NULL;
+            json_doc_release(doc);
+        }
+        EXPECT_EQ_INT(1, ok);
+    }
+#endif
+}
+
+#ifndef HADRJSON_NO_THREADS
+static void* test_free_worker(void* arg) {
+    json_value_t v;
+    int i;
+    for (i = 0; i < 500; i++) {
+        json_init(&v);
+        if (json_parse(&v, "[{\"a\":\"a string too long to be inline\"},[1,\"x\"]]") != JSON_PARSE_OK)
+            return arg;
+        json_free_deferred(&v);
+        if (i % 97 == 0)
+            json_free_drain();
+    }
+    return NULL;
+}
+#endif
+
+static void test_free() {
+    json_value_t v, *curr;
+    int i;
+
+    /* far deeper than the parser would go, json_free must not recurse */
+    json_init(&v);
+    curr = &v;
+    for (i = 0; i < 100000; i++) {
+        json_init(curr);
+        curr->type = JSON_ARRAY;
+        curr->u.a.size = 1;
+        curr->u.a.e = (json_value_t*)malloc(sizeof(json_value_t));
+        curr = curr->u.a.e;
+    }
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(curr, "{\"a\":[\"a string too long to be inline\"],\"b\":{}}"));
+    json_free(&v);
+    EXPECT_EQ_INT(JSON_NULL, json_type(&v));
+
+    for (i = 0; i < 200; i++) {
+        json_init(&v);
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\":[1,\"a string too long to be inline\",{\"b\":[]}],\"c\":\"x\"}"));
+        json_free_deferred(&v);
+        EXPECT_EQ_INT(JSON_NULL, json_type(&v));
+        if (i == 100)
+            json_free_drain();
+    }
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "\"a string too long to be inline\""));
+    json_free_deferred(&v);
+    EXPECT_EQ_INT(JSON_NULL, json_type(&v));
+    json_free_drain();
+    json_free_drain();
+
+#ifndef HADRJSON_NO_THREADS
+    /* deferred frees racing with drains from other threads */
+    {
+        pthread_t threads[4];
+        void* ret[4];
+        for (i = 0; i < 4; i++)
+            pthread_create(&threads[i], NULL, test_free_worker, NULL);
+        for (i = 0; i < 4; i++)
+            pthread_join(threads[i], &ret[i]);
+        json_free_drain();
+        EXPECT_EQ_INT(1, (ret[0] == NULL && ret[1] == NULL && ret[2] == NULL && ret[3] == NULL));
+    }
+#endif
+}
+
+#ifndef HADRJSON_NO_THREADS
+static void* test_doc_worker(void* arg) {
+    static const char* const path[] = { "list", "0" };
+    static const char* const name[] = { "user", "name" };
+    json_node_t node;
+    json_doc_t* next;
+    json_value_t v;
+    int i;
+    for (i = 0; i < 100000; i++) {
+        node = json_doc_node((json_doc_t*)arg, path, 2);
+        json_doc_release(json_doc_retain(node.doc));
+        json_node_release(&node);
+        /* edits of the same document race to share its storage */
+        json_init(&v);
+        v.type = JSON_TRUE;
+        if (json_doc_set(&next, (json_doc_t*)arg, name, 2, &v) == 0)
+            json_doc_release(next);
+    }
+    return NULL;
+}
+#endif
+
+static void test_doc() {
+    static const char* const name[] = { "user", "name" };
+    static const char* const mail[] = { "user", "mail" };
+    static const char* const second[] = { "list", "1" };
+    static const char* const bad[] = { "list", "2" };
+    static const char* const deep[] = { "nope", "x" };
+    json_doc_t *doc, *next, *last;
+    json_node_t node;
+    json_value_t v;
+    const json_value_t* root;
+    const void *data, *shared;
+    size_t size;
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_doc_parse(&doc,
+        "{\"user\":{\"name\":\"Ann\",\"bio\":\"a string too long to be inline\"},\"list\":[1,2],\"x\":true}"));
+    node = json_doc_node(doc, name, 2);
+    EXPECT_EQ_INT(1, (node.doc == doc));
+    json_doc_release(json_doc_retain(doc));
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "\"Bob\""));
+    EXPECT_EQ_INT(0, json_doc_set(&next, doc, name, 2, &v));
+    EXPECT_EQ_INT(JSON_NULL, json_type(&v));
+    json_doc_release(doc);
+    /* the node still holds the old document */
+    EXPECT_EQ_STRING("Ann", json_get_string(node.v), json_get_string_length(node.v));
+    json_node_release(&node);
+
+    root = json_doc_root(next);
+    EXPECT_EQ_SIZE_T(3, json_get_object_size(root));
+    EXPECT_EQ_STRING("Bob", json_get_string(json_get_object_value(json_get_object_value(root, 0), 0)), 3);
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[\"a\"]"));
+    EXPECT_EQ_INT(0, json_doc_set(&last, next, mail, 2, &v));
+    EXPECT_EQ_INT(0, json_doc_set(&doc, last, second, 2, &v));
+    EXPECT_EQ_INT(-1, json_doc_set(&node.doc, last, bad, 2, &v));
+    EXPECT_EQ_INT(-1, json_doc_set(&node.doc, last, deep, 2, &v));
+    EXPECT_EQ_INT(1, (node.doc == NULL));
+    node = json_doc_node(last, bad, 2);
+    EXPECT_EQ_INT(1, (node.doc == NULL && node.v == NULL));
+
+    /* untouched subtrees are shared, edited paths are not */
+    EXPECT_EQ_INT(JSON_FLAG_PACKED_INT, json_get_number_array(json_get_object_value(json_doc_root(last), 1), &data, &size));
+    EXPECT_EQ_INT(JSON_FLAG_PACKED_INT, json_get_number_array(json_get_object_value(json_doc_root(next), 1), &shared, &size));
+    EXPECT_EQ_INT(1, (data == shared));
+    /* each document boxes a shared packed array into elements of its own */
+    EXPECT_EQ_INT(1, (json_get_array_element(json_get_object_value(json_doc_root(last), 1), 0)
+        != json_get_array_element(json_get_object_value(json_doc_root(next), 1), 0)));
+    EXPECT_EQ_INT(1, (json_get_string(json_get_object_value(json_get_object_value(json_doc_root(last), 0), 1))
+        == json_get_string(json_get_object_value(json_get_object_value(root, 0), 1))));
+    EXPECT_EQ_SIZE_T(2, json_get_object_size(json_get_object_value(root, 0)));
+    EXPECT_EQ_SIZE_T(3, json_get_object_size(json_get_object_value(json_doc_root(last), 0)));
+    EXPECT_EQ_STRING("mail", json_get_object_key(json_get_object_value(json_doc_root(last), 0), 2), 4);
+    EXPECT_EQ_DOUBLE(2.0, json_get_number(json_get_array_element(json_get_object_value(json_doc_root(last), 1), 1)));
+    EXPECT_EQ_INT(JSON_NULL, json_type(json_get_array_element(json_get_object_value(json_doc_root(doc), 1), 1)));
+
+#ifndef HADRJSON_NO_THREADS
+    {
+        pthread_t threads[4];
+        int i;
+        for (i = 0; i < 4; i++)
+            pthread_create(&threads[i], NULL, test_doc_worker, last);
+        for (i = 0; i < 4; i++)
+            pthread_join(threads[i], NULL);
+    }
+#endif
+    json_doc_release(next);
+    json_doc_release(last);
+    EXPECT_EQ_INT(JSON_TRUE, json_type(json_get_object_value(json_doc_root(doc), 2)));
+    json_doc_release(doc);
+
+    EXPECT_EQ_INT(JSON_PARSE_EXPECT_VALUE, json_doc_parse(&doc, ""));
+    EXPECT_EQ_INT(1, (doc == NULL));
+}
+
+static void test_doc_reclaim() {
+    static const char* const name[] = { "user", "name" };
+    static const char* const bio[] = { "user", "bio" };
+    json_doc_t *doc, *next;
+    json_node_t node;
+    json_value_t v;
+    const void *data, *list;
+    const char* shared;
+    char big[4096];
+    size_t size;
+    int i, same = 1;
+#ifdef HEAP_IN_USE
+    size_t before;
+#endif
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_doc_parse(&doc,
+        "{\"user\":{\"name\":\"a string too long to be inline\",\"bio\":\"short\"},\"list\":[1,2,3]}"));
+    shared = json_get_string(json_get_object_value(json_get_object_value(json_doc_root(doc), 0), 0));
+    json_get_number_array(json_get_object_value(json_doc_root(doc), 1), &list, &size);
+    node = json_doc_node(doc, bio, 2);
+    memset(big, 'x', sizeof(big) - 1);
+    big[0] = big[sizeof(big) - 2] = '"';
+    big[sizeof(big) - 1] = '\0';
+#ifdef HEAP_IN_USE
+    before = HEAP_IN_USE();
+#endif
+    /* every edit replaces the bio of the previous version, which nothing else holds */
+    for (i = 0; i < 1000; i++) {
+        json_init(&v);
+        same &= json_parse(&v, big) == JSON_PARSE_OK && json_doc_set(&next, doc, bio, 2, &v) == 0;
+        json_doc_release(doc);
+        doc = next;
+        same &= json_get_string(json_get_object_value(json_get_object_value(json_doc_root(doc), 0), 0)) == shared;
+    }
+#ifdef HEAP_IN_USE
+    EXPECT_EQ_INT(1, (HEAP_IN_USE() < before + 16 * sizeof(big)));
+#endif
+    EXPECT_EQ_INT(1, same);
+    EXPECT_EQ_INT(JSON_FLAG_PACKED_INT, json_get_number_array(json_get_object_value(json_doc_root(doc), 1), &data, &size));
+    EXPECT_EQ_INT(1, (data == list));
+    EXPECT_EQ_SIZE_T(sizeof(big) - 3, json_get_string_length(json_get_object_value(json_get_object_value(json_doc_root(doc), 0), 1)));
+
+    /* the node still holds the first bio, and only that */
+    EXPECT_EQ_STRING("short", json_get_string(node.v), json_get_string_length(node.v));
+    json_node_release(&node);
+
+    /* replacing the shared name lets the last holder free it */
+    json_init(&v);
+    v.type = JSON_FALSE;
+    EXPECT_EQ_INT(0, json_doc_set(&next, doc, name, 2, &v));
+    json_doc_release(doc);
+    EXPECT_EQ_INT(JSON_FALSE, json_type(json_get_object_value(json_get_object_value(json_doc_root(next), 0), 0)));
+    json_doc_release(next);
+}
+
 int main() {
     test_parse();
+    test_parse_dialect();
+    test_parse_stats();
+    test_format();
+    test_bind();
+    test_bind_large();
+    test_parse_project();
+    test_free();
+    test_doc();
+    test_doc_reclaim();
+    test_parse_packed();
     printf("%d/%d (%3.2f%%) passed\n", test_pass, test_count, test_pass * 100.0 / test_count);
     return main_ret;
 }
\ No newline at end of file